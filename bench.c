@@ -0,0 +1,554 @@
+#include "teditor.h"
+
+/**
+ *
+ * Micro-benchmarks for teditor, built with 'make bench' and run as
+ * ./bench FILE, FILE should be large for the numbers to mean anything
+ *
+ */
+
+extern struct editor_config E;
+
+/********************************
+* Timing
+********************************/
+
+/**
+ * Returns a monotonic timestamp in seconds
+ */
+double bench_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/********************************
+* Benchmarks
+********************************/
+
+/**
+ * Times editor_index_lines() on the mapped file with one thread and with
+ * one thread per CPU, best of five runs each
+ */
+void bench_index_lines(int fd) {
+    if (editor_map_file(fd) == -1) {
+        printf("index: file can't be mapped\n");
+        return;
+    }
+    int threads[] = { 1, 0 };
+    for (int t = 0; t < 2; t++) {
+        double best = 1e9;
+        for (int run = 0; run < 5; run++) {
+            free(E.file.index);
+            double start = bench_now();
+            editor_index_lines(threads[t]);
+            double elapsed = bench_now() - start;
+            if (elapsed < best) {
+                best = elapsed;
+            }
+        }
+        printf("index (%s, %d-byte scan): %d lines in %.2f ms, %.1f Mlines/s, %.0f MB/s\n",
+          threads[t] ? "1 thread" : "all cpus", NEWLINE_SCAN_WIDTH, E.file.nlines, best * 1e3,
+          E.file.nlines / best / 1e6, E.file.size / best / 1e6);
+    }
+    editor_close_buffer();
+}
+
+/**
+ * Times goto-line and goto-byte jumps to random spots of generated files of
+ * increasing size, each jump splits the spans it lands in like the editor
+ * would
+ */
+void bench_goto() {
+    int sizes[] = { 10000, 100000, 1000000, 5000000 };
+    int jumps   = 100000;
+
+    for (int s = 0; s < 4; s++) {
+        char path[] = "/tmp/teditor-bench-XXXXXX";
+        int fd      = mkstemp(path);
+        FILE * fp   = fdopen(fd, "w");
+        if (fp == NULL) {
+            perror(path);
+            return;
+        }
+        for (int i = 0; i < sizes[s]; i++) {
+            fprintf(fp, "line %d of the jump benchmark\n", i);
+        }
+        fclose(fp);
+        editor_open(path);
+        unlink(path);
+
+        srand(1);
+        double start = bench_now();
+        for (int i = 0; i < jumps; i++) {
+            editor_row_at(rand() % E.numrows);
+        }
+        double lines = bench_now() - start;
+        int cx;
+        start = bench_now();
+        for (int i = 0; i < jumps; i++) {
+            editor_offset_to_line((size_t)rand() % E.file.size, &cx);
+        }
+        double bytes = bench_now() - start;
+        printf("goto (%d lines): line %.2f us/jump, byte %.2f us/jump\n",
+          sizes[s], lines / jumps * 1e6, bytes / jumps * 1e6);
+        editor_close_buffer();
+        free(E.filename);
+        E.filename = NULL;
+    }
+}
+
+/**
+ * Times a soft wrapped page down, redraw included, through files of ever
+ * more lines of 2000 bytes each, which should not get any slower as the
+ * file grows
+ */
+void bench_wrap() {
+    int sizes[] = { 1000, 10000, 50000 };
+    int out     = dup(STDOUT_FILENO);
+    int null    = open("/dev/null", O_WRONLY);
+
+    for (int s = 0; s < 3; s++) {
+        char path[] = "/tmp/teditor-bench-XXXXXX";
+        int fd      = mkstemp(path);
+        FILE * fp   = fdopen(fd, "w");
+        if (fp == NULL) {
+            perror(path);
+            return;
+        }
+        for (int i = 0; i < sizes[s]; i++) {
+            for (int len = 0; len < 2000; len += 20) {
+                fprintf(fp, "%-19d ", i);
+            }
+            fputc('\n', fp);
+        }
+        fclose(fp);
+        editor_open(path);
+        unlink(path);
+        E.row  = 22;
+        E.col  = 80;
+        E.wrap = 1;
+        dup2(null, STDOUT_FILENO);
+        int pages    = 0;
+        double start = bench_now();
+        while (E.cy < E.numrows - 1 && pages < 20000) {
+            editor_wrap_page(2 * E.row - 1);
+            editor_refresh_screen();
+            pages++;
+        }
+        double elapsed = bench_now() - start;
+        dup2(out, STDOUT_FILENO);
+        printf("wrap (%d lines of 2000 bytes): %.1f us/page\n", sizes[s], elapsed / pages * 1e6);
+        E.wrap    = 0;
+        E.wrapoff = 0;
+        editor_close_buffer();
+        free(E.filename);
+        E.filename = NULL;
+    }
+    close(null);
+    close(out);
+}
+
+/**
+ * Counts the bytes an 80x24 refresh sends while typing in the middle of the
+ * screen and while scrolling through the file, with the differential
+ * renderer and with every frame repainted in full
+ */
+void bench_refresh(const char * path) {
+    int out  = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+
+    for (int full = 0; full < 2; full++) {
+        editor_open((char *)path);
+        E.row = 22;
+        E.col = 80;
+        E.cx  = 0;
+        E.cy  = E.numrows > 10 ? 10 : 0;
+        dup2(null, STDOUT_FILENO);
+        long long typing = 0;
+        long long scrolling = 0;
+        for (int i = 0; i < 200; i++) {
+            E.screen.valid = E.screen.valid && !full;
+            editor_insert_char((i % 16 == 0) ? '"' : 'a' + i % 26);
+            editor_refresh_screen();
+            typing += E.screen.frame_bytes;
+        }
+        for (int i = 0; i < 200; i++) {
+            E.screen.valid = E.screen.valid && !full;
+            editor_move_cursor(ARROW_DOWN);
+            editor_refresh_screen();
+            scrolling += E.screen.frame_bytes;
+        }
+        dup2(out, STDOUT_FILENO);
+        printf("refresh (%s): typing %lld bytes/frame, scrolling %lld bytes/frame\n",
+          full ? "full repaint" : "differential", typing / 200, scrolling / 200);
+        editor_close_buffer();
+        free(E.filename);
+        E.filename = NULL;
+        E.dirty    = 0;
+    }
+    close(null);
+    close(out);
+}
+
+/**
+ * The append buffer as it used to be, one realloc per append and a new
+ * buffer for every frame, kept to compare against
+ */
+void bench_ab_append_realloc(struct abuf * ab, const char * s, int len) {
+    char * new = realloc(ab->b, ab->len + len);
+
+    if (new == NULL) {
+        return;
+    }
+    memcpy(&new[ab->len], s, len);
+    ab->b    = new;
+    ab->len += len;
+}
+
+/**
+ * Times building a full 80x24 frame, one byte per cell and a color change
+ * every few cells, with a fresh realloc-per-append buffer and with a reused
+ * one
+ */
+void bench_abuf() {
+    int frames = 20000;
+    struct abuf reused = { NULL, 0, 0 };
+
+    for (int mode = 0; mode < 2; mode++) {
+        double start = bench_now();
+        for (int f = 0; f < frames; f++) {
+            struct abuf fresh = { NULL, 0, 0 };
+            struct abuf * ab  = mode ? &reused : &fresh;
+            ab_reset(ab);
+            for (int y = 0; y < 24; y++) {
+                for (int x = 0; x < 80; x++) {
+                    char c = 'a' + (x + y + f) % 26;
+                    if (mode == 0) {
+                        if (x % 6 == 0) {
+                            bench_ab_append_realloc(ab, "\x1b[36m", 5);
+                        }
+                        bench_ab_append_realloc(ab, &c, 1);
+                    }
+                    else {
+                        if (x % 6 == 0) {
+                            ab_append(ab, "\x1b[36m", 5);
+                        }
+                        ab_putc(ab, c);
+                    }
+                }
+                if (mode == 0) {
+                    bench_ab_append_realloc(ab, "\x1b[K\r\n", 5);
+                }
+                else {
+                    ab_append(ab, "\x1b[K\r\n", 5);
+                }
+            }
+            if (mode == 0) {
+                ab_free(ab);
+            }
+        }
+        double elapsed = bench_now() - start;
+        printf("abuf (%s): %.2f us/frame\n", mode ? "reused, geometric" : "realloc per append",
+          elapsed / frames * 1e6);
+    }
+    ab_free(&reused);
+}
+
+/**
+ * Times building full frames of a 300x80 terminal over a generated C file
+ * whose lines fill the width with keywords, numbers, strings and comments,
+ * every row is highlighted already so only drawing and output are measured
+ */
+void bench_frame() {
+    int out    = dup(STDOUT_FILENO);
+    int null   = open("/dev/null", O_WRONLY);
+    int frames = 2000;
+    char path[] = "/tmp/teditor-bench-XXXXXX.c";
+    int fd      = mkstemps(path, 2);
+    FILE * fp   = fdopen(fd, "w");
+
+    if (fp == NULL) {
+        perror(path);
+        return;
+    }
+    for (int i = 0; i < 1000; i++) {
+        int len = 0;
+        while (len < 290) {
+            len += fprintf(fp, "if (x%d == %d) return \"s%d\"; /* c */ ", i, len, len);
+        }
+        fputc('\n', fp);
+    }
+    fclose(fp);
+    editor_open(path);
+    unlink(path);
+    E.row = 78;
+    E.col = 300;
+    dup2(null, STDOUT_FILENO);
+    for (int y = 0; y < E.numrows; y++) {
+        editor_prepare_row(editor_row_at(y));
+    }
+    double start = bench_now();
+    for (int f = 0; f < frames; f++) {
+        E.cy           = (f * 7) % (E.numrows - E.row);
+        E.rowoff       = E.cy;
+        E.screen.valid = 0;
+        editor_refresh_screen();
+    }
+    double elapsed = bench_now() - start;
+    dup2(out, STDOUT_FILENO);
+    printf("frame (300x80, dense C, full repaint): %.1f us/frame, %d bytes/frame\n",
+      elapsed / frames * 1e6, E.screen.frame_bytes);
+    editor_close_buffer();
+    free(E.filename);
+    E.filename = NULL;
+    close(null);
+    close(out);
+}
+
+/**
+ * Times a keystroke, redraw included, in the middle of a 20 MB line of C
+ * with highlighting on, typing and moving along the line and then jumping to
+ * its end, which only the chunks near the cursor should have to pay for.
+ * The after rows below it are on screen too, and typing a quote must not
+ * scan the rest of the line on the spot to find how they start
+ */
+void bench_long(int after) {
+    char path[] = "/tmp/teditor-bench-XXXXXX.c";
+    int fd      = mkstemps(path, 2);
+    FILE * fp   = fdopen(fd, "w");
+    if (fp == NULL) {
+        perror(path);
+        return;
+    }
+    for (int i = 0; ftell(fp) < 20 * 1024 * 1024; i++) {
+        fprintf(fp, "if (x%d > 0) { /* %d */ s = \"a\\tb\"; n += 0x%x;\treturn; } ", i, i, i);
+    }
+    fputc('\n', fp);
+    for (int i = 0; i < after; i++) {
+        fprintf(fp, "int y%d = %d;\n", i, i);
+    }
+    fclose(fp);
+    editor_open(path);
+    unlink(path);
+    E.row = 22;
+    E.col = 80;
+    E.cy  = 0;
+    E.cx  = editor_row_at(0)->size / 2;
+
+    int out  = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    editor_refresh_screen();
+    double start = bench_now();
+    for (int i = 0; i < 1000; i++) {
+        editor_insert_char((i % 16 == 0) ? '"' : 'a' + i % 26);
+        editor_refresh_screen();
+    }
+    double typed = bench_now() - start;
+    start = bench_now();
+    for (int i = 0; i < 1000; i++) {
+        editor_move_cursor((i % 100 < 50) ? ARROW_RIGHT : ARROW_LEFT);
+        editor_refresh_screen();
+    }
+    double moved = bench_now() - start;
+    start = bench_now();
+    E.cx = editor_row_at(0)->size;
+    editor_refresh_screen();
+    double end = bench_now() - start;
+    dup2(out, STDOUT_FILENO);
+    printf("long line (20 MB, %d rows after): %.1f us/keystroke typing, %.1f us/keystroke moving, %.1f us to its end\n",
+      after, typed / 1000 * 1e6, moved / 1000 * 1e6, end * 1e6);
+    editor_close_buffer();
+    free(E.filename);
+    E.filename = NULL;
+    close(null);
+    close(out);
+}
+
+/**
+ * Times opening and closing a comment at the top of a 200000 line file
+ * whose rows are all highlighted, redraw included, which should only cost
+ * the rows on screen
+ */
+void bench_comment() {
+    char path[] = "/tmp/teditor-bench-XXXXXX.c";
+    int fd      = mkstemps(path, 2);
+    FILE * fp   = fdopen(fd, "w");
+    if (fp == NULL) {
+        perror(path);
+        return;
+    }
+    for (int i = 0; i < 200000; i++) {
+        fprintf(fp, "int x%d = %d; // %d\n", i, i, i);
+    }
+    fclose(fp);
+    editor_open(path);
+    unlink(path);
+    E.row = 22;
+    E.col = 80;
+    for (erow * row = editor_row_at(0); row; row = editor_row_next(row)) {
+        editor_prepare_row(row);
+    }
+
+    int out  = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    E.cx = 0;
+    E.cy = 0;
+    editor_refresh_screen();
+    double start = bench_now();
+    for (int i = 0; i < 100; i++) {
+        editor_insert_char('/');
+        editor_insert_char('*');
+        editor_refresh_screen();
+        editor_del_char();
+        editor_del_char();
+        editor_refresh_screen();
+    }
+    double elapsed = bench_now() - start;
+    dup2(out, STDOUT_FILENO);
+    printf("comment (200000 lines): %.1f us to open or close it\n", elapsed / 200 * 1e6);
+    editor_close_buffer();
+    free(E.filename);
+    E.filename = NULL;
+    close(null);
+    close(out);
+}
+
+/**
+ * Times drawing the end of a 1000000 line file with multiline comments right
+ * after opening it, and how long the worker takes to find the state of
+ * every line, see "Background Highlighting"
+ */
+void bench_jump() {
+    char path[] = "/tmp/teditor-bench-XXXXXX.c";
+    int fd      = mkstemps(path, 2);
+    FILE * fp   = fdopen(fd, "w");
+    if (fp == NULL) {
+        perror(path);
+        return;
+    }
+    for (int i = 0; i < 1000000; i++) {
+        fprintf(fp, (i % 1000 == 0) ? "/* %d\n" : (i % 1000 == 500) ? "%d */\n" : "int x%d = 1;\n", i);
+    }
+    fclose(fp);
+    E.row = 22;
+    E.col = 80;
+
+    int out  = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    double start = bench_now();
+    editor_open(path);
+    E.cx = 0;
+    E.cy = E.numrows - 1;
+    editor_refresh_screen();
+    double frame = bench_now() - start;
+    while (E.hl_worker.running) {
+        editor_hl_worker_poll();
+        usleep(100);
+    }
+    double done = bench_now() - start;
+    dup2(out, STDOUT_FILENO);
+    printf("jump (1000000 lines): %.2f ms to draw the end after opening, states found in %.1f ms\n",
+      frame * 1e3, done * 1e3);
+    unlink(path);
+    editor_close_buffer();
+    free(E.filename);
+    E.filename = NULL;
+    close(null);
+    close(out);
+}
+
+/**
+ * Times highlighting every row of a generated C file of about 10 MB, with
+ * indentation, keywords, numbers, strings and comments in the proportions
+ * of real code, best of five passes
+ */
+void bench_highlight() {
+    const char * lines[] = {
+        "/*",
+        " * Comment %d explaining what the function below does, in some detail",
+        " */",
+        "int editor_function_%d(struct editor_row * row, const char * s, int len) {",
+        "    for (int i = 0; i < len; i++) { // Walk the bytes of the row",
+        "        if (row->chars[i] == '\\t' && s[i] != \"x%d\"[0]) {",
+        "            total += 0x%x * sizeof(struct editor_row);",
+        "        }",
+        "    }",
+        "    return snprintf(buf, sizeof(buf), \"row %%d of %%d\\n\", %d, len);",
+        "}",
+        "",
+    };
+    int nlines  = sizeof(lines) / sizeof(lines[0]);
+    char path[] = "/tmp/teditor-bench-XXXXXX.c";
+    int fd      = mkstemps(path, 2);
+    FILE * fp   = fdopen(fd, "w");
+    if (fp == NULL) {
+        perror(path);
+        return;
+    }
+    for (int i = 0; i < 240000; i++) {
+        fprintf(fp, lines[i % nlines], i);
+        fputc('\n', fp);
+    }
+    fclose(fp);
+    editor_open(path);
+    unlink(path);
+    editor_hl_worker_stop();
+    E.row = 22;
+    E.col = 80;
+
+    long long bytes = 0;
+    for (erow * row = editor_row_at(0); row; row = editor_row_next(row)) {
+        editor_prepare_row(row);
+        bytes += row->rsize;
+    }
+    double best = 1e9;
+    for (int run = 0; run < 5; run++) {
+        double start = bench_now();
+        for (erow * row = editor_row_at(0); row; row = editor_row_next(row)) {
+            editor_update_syntax(row);
+        }
+        double elapsed = bench_now() - start;
+        if (elapsed < best) {
+            best = elapsed;
+        }
+    }
+    printf("highlight (%.1f MB of C, %d-byte runs): %.1f MB/s\n", bytes / 1e6, RUN_SCAN_WIDTH, bytes / best / 1e6);
+    editor_close_buffer();
+    free(E.filename);
+    E.filename = NULL;
+}
+
+/**
+ * Runs every benchmark against the file given on the command line
+ */
+int main(int argc, char * argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s FILE\n", argv[0]);
+        return 1;
+    }
+    int fd = open(argv[1], O_RDONLY);
+    if (fd == -1) {
+        perror(argv[1]);
+        return 1;
+    }
+    bench_index_lines(fd);
+    close(fd);
+    E.tab_stop = 8; // init_editor() is not run, it wants a terminal
+    pthread_mutex_init(&E.hl_worker.lock, NULL);
+    bench_goto();
+    bench_refresh(argv[1]);
+    bench_abuf();
+    bench_frame();
+    bench_wrap();
+    bench_long(0);
+    bench_long(21);
+    bench_comment();
+    bench_jump();
+    bench_highlight();
+    return 0;
+}
@@ -14,59 +14,226 @@
 * Defines
 ********************************/
 #define TEDITOR_VERSION      "0.0.1"
-#define TEDITOR_TAB_STOP     8
+#define TEDITOR_TAB_STOP     8 // Default for E.tab_stop, see editor_set_tab_stop()
 #define TEDITOR_QUIT_TIMES   3
+#define TEDITOR_FPS          60
+#define TEDITOR_FPS_MAX      1000 // Any more and E.frame_ms would round down to no cap
+#define TEDITOR_GAP_MIN      16
+#define POOL_MIN_SIZE        16
+#define POOL_MAX_SIZE        (POOL_MIN_SIZE << (POOL_CLASSES - 1))
+#define POOL_SLAB_SIZE       (64 * 1024)
 #define CTRL_KEY(k) ((k) & 0x1f)
-#define ABUF_INIT            { NULL, 0 }
+#define ABUF_INIT            { NULL, 0, 0 }
+#define ABUF_MIN_SIZE        4096
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
-#define HL_HIGHLIGHT_STRINGS (1 << 1)
+#define HL_REGION_ESCAPES    (1 << 0) // A backslash escapes the byte after it
+#define HL_REGION_MULTILINE  (1 << 1) // The region goes on past the end of the row
+#define HL_REGION_AFTER_SEP  (1 << 2) // Only opens where a word could start
+#define HL_ACT_OPEN          (1 << 0) // The byte may open a region
+#define HL_ACT_CLOSE         (1 << 1) // The byte may close the region
+#define HL_ACT_ESCAPE        (1 << 2) // The byte escapes the one after it
+#define HL_ACT_KEYWORD       (1 << 3) // The byte starts a word that may be a keyword
+#define ROW_RENDER_VALID     (1 << 0)
+#define ROW_HL_VALID         (1 << 1)
+#define ROW_SPAN             (1 << 2)
+#define ROW_MAPPED           (1 << 3)
+#define ROW_HL_STALE         (1 << 4)
+#define ROW_HL_GUESS         (1 << 5)
+#define ROW_HL_ENDS          (1 << 6) // Only hl_end_state is up to date, see editor_syntax_row_end()
+#define TEDITOR_INDEX_STRIDE 64
+#define TEDITOR_INDEX_CHUNK  (8 * 1024 * 1024)
+#define TEDITOR_INDEX_THREADS 16
+#define TEDITOR_PAGER_THRESHOLD (256LL * 1024 * 1024)
+#define TEDITOR_PAGER_MARGIN 512
+#define TEDITOR_PAGER_ROWS   (8 * TEDITOR_PAGER_MARGIN)
 #define HLDB_ENTRIES         (sizeof(HLDB) / sizeof(HLDB[0]))
-
-#define _DEFAULT_SOURCE
-#define _BSD_SOURCE
-#define _GNU_SOURCE
+#define UTF8_CONT(c)         (((c) & 0xc0) == 0x80)
+#define UTF8_INVALID         0x110000
+#define ROW_CHAR(row, i)     ((i) < (row)->gap_start ? (row)->chars[i] : (row)->chars[(i) + (row)->gap_len])
+#define ROW_LONG_SIZE        (16 * 1024) // Rows this long are chunked, see "Long Rows"
+#define ROW_CHUNK_SIZE       512
+#define ROW_CHUNK_MAX        (2 * ROW_CHUNK_SIZE)
+#define FIND_STRADDLE_MAX    256 // Bytes from either side of the gap copied to find a match across it
+#define HL_WORKER_BATCH      4096 // Lines the worker publishes at a time
+#define HL_GUESS_ROWS        1024 // Rows to walk back before guessing, see "Background Highlighting"
+#define HL_KEYWORD_SLOTS     (1 << 20) // Most slots a keyword table grows to, see editor_syntax_compile_keywords()
+#define HL_SYNTAX_FILE_MAX   (1024 * 1024) // Largest syntax file read, see editor_load_syntax()
+#define HL_CACHE_MAGIC       "tedlex1" // Changes whenever the layout of a lexer does
+#define HL_SEPARATORS        ",.()+-/*~%<>[];" // Separators besides whitespace of a syntax naming none
+#define HL_LOOKAHEAD         64 // Longest keyword or comment delimiter a chunk scan can run into
+#define HL_IDLE_CHUNKS       256 // Chunks of E.hl_long scanned between checks for input
+#define HL_STATE_DFA         0xff // Lexer state, see editor_syntax_compile()
+#define HL_DFA_SEP           0    // Last character was a separator
+#define HL_DFA_WORD          1    // In a word
+#define HL_DFA_NUMBER        2    // Last character was part of a number
+#define HL_DFA_REGION        3    // In the first region, the next state in the second and so on
+#define HL_STATE_SKIP(n, hl) (((n) << 12) | ((hl) << 24)) // Bytes of a token that started earlier
+#define HL_STATE_SKIP_LEN(s) (((s) >> 12) & 0xfff)
+#define HL_STATE_SKIP_HL(s)  (((s) >> 24) & 0xf)
 
 /********************************
 * Data
 ********************************/
 struct editor_config E;
-char * C_HL_extensions[] = { ".c", ".h", ".cpp", NULL };
-char * C_HL_keywords[]   = { "switch", "if",      "while",   "for",    "break",     "continue", "return", "else",
-                             "struct",   "union",   "typedef", "static", "enum",      "class",    "case",   "int|",
-                             "long|",    "double|", "float|",  "char|",  "unsigned|", "signed|",  "void|",  NULL };
+char * C_HL_extensions[] = { ".c", ".h", ".cpp", ".hpp", ".cc", ".cxx", ".hh", NULL };
+char * C_HL_keywords[]   = { "switch",   "if",       "while",     "for",       "break",    "continue", "return",  "else",
+                             "struct",   "union",    "typedef",   "static",    "enum",     "class",    "case",    "default",
+                             "do",       "goto",     "sizeof",    "extern",    "const",    "volatile", "inline",  "register",
+                             "public",   "private",  "protected", "virtual",   "template", "typename", "namespace",
+                             "using",    "new",      "delete",    "try",       "catch",    "throw",    "operator",
+                             "int|",     "long|",    "double|",   "float|",    "char|",    "unsigned|", "signed|",
+                             "void|",    "short|",   "bool|",     "size_t|",   "auto|",    NULL };
+struct hl_region C_HL_regions[] = {
+    { "//",   NULL,   HL_COMMENT,   0                   },
+    { "/*",   "*/",   HL_MLCOMMENT, HL_REGION_MULTILINE },
+    { "\"",   "\"",   HL_STRING,    HL_REGION_ESCAPES   },
+    { "'",    "'",    HL_STRING,    HL_REGION_ESCAPES   },
+    { NULL,   NULL,   0,            0                   },
+};
+char * PY_HL_extensions[] = { ".py", ".pyw", NULL };
+char * PY_HL_keywords[]   = { "and",    "as",    "assert", "async",  "await",    "break",   "class",  "continue",
+                              "def",    "del",   "elif",   "else",   "except",   "finally", "for",    "from",
+                              "global", "if",    "import", "in",     "is",       "lambda",  "nonlocal", "not",
+                              "or",     "pass",  "raise",  "return", "try",      "while",   "with",   "yield",
+                              "True|",  "False|", "None|", "int|",   "float|",   "str|",    "bytes|", "list|",
+                              "dict|",  "set|",  "tuple|", "bool|",  "object|",  "self|",   NULL };
+struct hl_region PY_HL_regions[] = {
+    { "#",    NULL,   HL_COMMENT,   0                                       },
+    { "\"\"\"", "\"\"\"", HL_STRING, HL_REGION_ESCAPES | HL_REGION_MULTILINE },
+    { "'''",  "'''",  HL_STRING,    HL_REGION_ESCAPES | HL_REGION_MULTILINE },
+    { "\"",   "\"",   HL_STRING,    HL_REGION_ESCAPES                       },
+    { "'",    "'",    HL_STRING,    HL_REGION_ESCAPES                       },
+    { NULL,   NULL,   0,            0                                       },
+};
+char * GO_HL_extensions[] = { ".go", NULL };
+char * GO_HL_keywords[]   = { "break",   "case",     "chan",    "const",   "continue", "default",  "defer",   "else",
+                              "fallthrough", "for",  "func",    "go",      "goto",     "if",       "import",  "interface",
+                              "map",     "package",  "range",   "return",  "select",   "struct",   "switch",  "type",
+                              "var",     "nil|",     "true|",   "false|",  "int|",     "int8|",    "int16|",  "int32|",
+                              "int64|",  "uint|",    "uint8|",  "uint16|", "uint32|",  "uint64|",  "uintptr|", "float32|",
+                              "float64|", "complex64|", "complex128|", "byte|", "rune|", "string|", "bool|",  "error|",
+                              "any|",    NULL };
+struct hl_region GO_HL_regions[] = {
+    { "//",   NULL,   HL_COMMENT,   0                   },
+    { "/*",   "*/",   HL_MLCOMMENT, HL_REGION_MULTILINE },
+    { "\"",   "\"",   HL_STRING,    HL_REGION_ESCAPES   },
+    { "'",    "'",    HL_STRING,    HL_REGION_ESCAPES   },
+    { "`",    "`",    HL_STRING,    HL_REGION_MULTILINE },
+    { NULL,   NULL,   0,            0                   },
+};
+char * RS_HL_extensions[] = { ".rs", NULL };
+char * RS_HL_keywords[]   = { "as",      "async",    "await",   "break",   "const",    "continue", "crate",   "dyn",
+                              "else",    "enum",     "extern",  "fn",      "for",      "if",       "impl",    "in",
+                              "let",     "loop",     "match",   "mod",     "move",     "mut",      "pub",     "ref",
+                              "return",  "static",   "struct",  "super",   "trait",    "type",     "unsafe",  "use",
+                              "where",   "while",    "self|",   "Self|",   "true|",    "false|",   "i8|",     "i16|",
+                              "i32|",    "i64|",     "i128|",   "isize|",  "u8|",      "u16|",     "u32|",    "u64|",
+                              "u128|",   "usize|",   "f32|",    "f64|",    "bool|",    "char|",    "str|",    "String|",
+                              "Vec|",    "Option|",  "Result|", "Box|",    "Some|",    "None|",    "Ok|",     "Err|",
+                              NULL };
+struct hl_region RS_HL_regions[] = {
+    { "//",   NULL,   HL_COMMENT,   0                                       },
+    { "/*",   "*/",   HL_MLCOMMENT, HL_REGION_MULTILINE                     },
+    { "\"",   "\"",   HL_STRING,    HL_REGION_ESCAPES | HL_REGION_MULTILINE },
+    { NULL,   NULL,   0,            0                                       },
+};
+char * SH_HL_extensions[] = { ".sh", ".bash", ".zsh", ".bashrc", ".profile", NULL };
+char * SH_HL_keywords[]   = { "if",      "then",     "else",    "elif",    "fi",       "case",     "esac",    "for",
+                              "select",  "while",    "until",   "do",      "done",     "in",       "function", "time",
+                              "return",  "exit",     "break",   "continue", "local",   "export",   "readonly", "declare",
+                              "echo|",   "printf|",  "read|",   "cd|",     "set|",     "unset|",   "shift|",  "source|",
+                              "eval|",   "exec|",    "test|",   "trap|",   "true|",    "false|",   NULL };
+struct hl_region SH_HL_regions[] = {
+    { "#",    NULL,   HL_COMMENT,   HL_REGION_AFTER_SEP                     },
+    { "\"",   "\"",   HL_STRING,    HL_REGION_ESCAPES | HL_REGION_MULTILINE },
+    { "'",    "'",    HL_STRING,    HL_REGION_MULTILINE                     },
+    { NULL,   NULL,   0,            0                                       },
+};
+char * JSON_HL_extensions[] = { ".json", NULL };
+char * JSON_HL_keywords[]   = { "true|", "false|", "null|", NULL };
+struct hl_region JSON_HL_regions[] = {
+    { "\"",   "\"",   HL_STRING,    HL_REGION_ESCAPES   },
+    { NULL,   NULL,   0,            0                   },
+};
+char * YAML_HL_extensions[] = { ".yaml", ".yml", NULL };
+char * YAML_HL_keywords[]   = { "true|", "false|", "yes|", "no|", "on|", "off|", "null|", "True|", "False|", "Null|",
+                                NULL };
+struct hl_region YAML_HL_regions[] = {
+    { "#",    NULL,   HL_COMMENT,   HL_REGION_AFTER_SEP },
+    { "\"",   "\"",   HL_STRING,    HL_REGION_ESCAPES   },
+    { "'",    "'",    HL_STRING,    0                   },
+    { NULL,   NULL,   0,            0                   },
+};
 struct editor_syntax HLDB[] = {
-    {
-        "c",
-        C_HL_extensions,
-        C_HL_keywords,
-        "//", "/*", "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
-    },
+    { "c",      C_HL_extensions,    C_HL_keywords,    C_HL_regions,    NULL,
+      HL_HIGHLIGHT_NUMBERS, NULL, NULL, 0 },
+    { "python", PY_HL_extensions,   PY_HL_keywords,   PY_HL_regions,   ",.()+-/*=~%<>[];:{}@",
+      HL_HIGHLIGHT_NUMBERS, NULL, NULL, 0 },
+    { "go",     GO_HL_extensions,   GO_HL_keywords,   GO_HL_regions,   ",.()+-/*=~%<>[];:{}&|!^",
+      HL_HIGHLIGHT_NUMBERS, NULL, NULL, 0 },
+    { "rust",   RS_HL_extensions,   RS_HL_keywords,   RS_HL_regions,   ",.()+-/*=~%<>[];:{}&|!^?#'",
+      HL_HIGHLIGHT_NUMBERS, NULL, NULL, 0 },
+    { "sh",     SH_HL_extensions,   SH_HL_keywords,   SH_HL_regions,   "()<>[];|&=`",
+      HL_HIGHLIGHT_NUMBERS, NULL, NULL, 0 },
+    { "json",   JSON_HL_extensions, JSON_HL_keywords, JSON_HL_regions, ",:[]{}-",
+      HL_HIGHLIGHT_NUMBERS, NULL, NULL, 0 },
+    { "yaml",   YAML_HL_extensions, YAML_HL_keywords, YAML_HL_regions, ",:[]{}-",
+      HL_HIGHLIGHT_NUMBERS, NULL, NULL, 0 },
 };
 
 /********************************
 * Init
 ********************************/
 
+#ifndef TEDITOR_NO_MAIN
+
 /**
  * teditor main method
  */
 int main(int argc, char * argv[]) {
+    int opt;
+    int pager = 0;
+    int wrap  = 0;
+    int fps   = TEDITOR_FPS;
+
+    while ((opt = getopt(argc, argv, "pwf:")) != -1) {
+        switch (opt) {
+            case 'p':
+                pager = 1;
+                break;
+            case 'w':
+                wrap = 1;
+                break;
+            case 'f':
+                fps = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-p] [-w] [-f fps] [file]\n", argv[0]);
+                exit(1);
+        }
+    }
     enable_raw_mode();
     init_editor();
-    if (argc >= 2) {
-        editor_open(argv[1]);
+    E.pager    = pager;
+    E.wrap     = wrap;
+    E.frame_ms = (fps > 0) ? 1000 / (fps < TEDITOR_FPS_MAX ? fps : TEDITOR_FPS_MAX) : 0;
+    if (optind < argc) {
+        editor_open(argv[optind]);
     }
 
-    editor_set_status_message("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+    if (E.statusmsg[0] == '\0') { // Unless a syntax file had something to say
+        editor_set_status_message("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-G/B = goto line/byte");
+    }
 
     while (1) {
         editor_refresh_screen();
-        editor_process_keypress();
+        editor_process_input();
     }
     return 0;
 }
 
+#endif /* TEDITOR_NO_MAIN */
+
 /**
  * Intializes struct editor_config
  */
@@ -76,6 +243,9 @@ void init_editor() {
     E.rx             = 0;
     E.rowoff         = 0;
     E.coloff         = 0;
+    E.wrap           = 0;
+    E.wrapoff        = 0;
+    E.wrap_y         = 0;
     E.numrows        = 0;
     E.editor_row     = NULL;
     E.dirty          = 0;
@@ -83,10 +253,39 @@ void init_editor() {
     E.statusmsg[0]   = '\0';
     E.statusmsg_time = 0;
     E.syntax         = NULL;
+    E.syntaxes       = NULL;
+    E.nsyntaxes      = 0;
+    memset(&E.pool, 0, sizeof(E.pool));
+    memset(&E.file, 0, sizeof(E.file));
+    memset(&E.save, 0, sizeof(E.save));
+    pthread_mutex_init(&E.save.lock, NULL);
+    E.pager          = 0;
+    E.mapped_rows    = 0;
+    E.hl_stale       = NULL;
+    E.hl_stale_rows  = 0;
+    E.hl_long        = NULL;
+    memset(&E.hl_worker, 0, sizeof(E.hl_worker));
+    pthread_mutex_init(&E.hl_worker.lock, NULL);
+    memset(&E.screen, 0, sizeof(E.screen));
+    E.input.len      = 0;
+    E.input.pos      = 0;
+    E.frame_ms       = 0;
+    E.tab_stop       = TEDITOR_TAB_STOP;
+    char * tab_stop  = getenv("TEDITOR_TAB_STOP");
+    if (tab_stop && atoi(tab_stop) > 0) {
+        E.tab_stop = atoi(tab_stop);
+    }
+    editor_init_syntaxes();
     if (get_window_size(&E.row, &E.col) == -1) {
         unix_error("get_window_size");
     }
     E.row -= 2;
+    E.resized = 0;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = editor_sigwinch;
+    sa.sa_flags   = SA_RESTART;
+    sigaction(SIGWINCH, &sa, NULL);
 }
 
 /********************************
@@ -97,21 +296,21 @@ void init_editor() {
  * Allows user to move cursor with the arrow keys
  */
 void editor_move_cursor(int key) {
-    erow * row = (E.cy >= E.numrows) ? NULL : &E.editor_row[E.cy];
+    erow * row = editor_row_at(E.cy);
 
     switch (key) {
         case ARROW_LEFT:
             if (E.cx != 0) {
-                E.cx--;
+                E.cx = editor_row_prev_char(row, E.cx);
             }
             else if (E.cy > 0) { // Moving left at the start of a line goes back a line
                 E.cy--;
-                E.cx = E.editor_row[E.cy].size;
+                E.cx = editor_row_at(E.cy)->size;
             }
             break;
         case ARROW_RIGHT:
             if (row && E.cx < row->size) { // Limit scrolling to the right
-                E.cx++;
+                E.cx = editor_row_next_char(row, E.cx);
             }
             else if (row && E.cx == row->size) { // Moving right at the end of a line goes to next line
                 E.cy++;
@@ -130,11 +329,14 @@ void editor_move_cursor(int key) {
             break;
     }
     // Snap cursor to the end of a line, prevents going past end when switching lines
-    row = (E.cy >= E.numrows) ? NULL : &E.editor_row[E.cy];
+    row = editor_row_at(E.cy);
     int rowlen = row ? row->size : 0;
     if (E.cx > rowlen) {
         E.cx = rowlen;
     }
+    if (E.cx < rowlen && UTF8_CONT(ROW_CHAR(row, E.cx))) { // Never stop inside a character
+        E.cx = editor_row_prev_char(row, E.cx);
+    }
 } /* editor_move_cursor */
 
 /**
@@ -149,6 +351,7 @@ void editor_process_keypress() {
             editor_insert_newline();
             break;
         case CTRL_KEY('q'):
+            editor_save_wait();
             if (E.dirty && quit_times > 0) {
                 editor_set_status_message("WARNING: File has unsaved changes. "
                   "Press Ctrl-Q %d more times to quit.", quit_times);
@@ -167,12 +370,24 @@ void editor_process_keypress() {
             break;
         case END_KEY:
             if (E.cy < E.numrows) {
-                E.cx = E.editor_row[E.cy].size;
+                E.cx = editor_row_at(E.cy)->size;
             }
             break;
         case CTRL_KEY('f'):
             editor_find();
             break;
+        case CTRL_KEY('g'):
+            editor_goto_line();
+            break;
+        case CTRL_KEY('b'):
+            editor_goto_offset();
+            break;
+        case CTRL_KEY('t'):
+            editor_set_tab_stop();
+            break;
+        case CTRL_KEY('w'):
+            editor_toggle_wrap();
+            break;
         case BACKSPACE:
         case CTRL_KEY('h'):
         case DEL_KEY:
@@ -182,22 +397,19 @@ void editor_process_keypress() {
             editor_del_char();
             break;
         case PAGE_UP:
-        case PAGE_DOWN: {
-            if (c == PAGE_UP) {
-                E.cy = E.rowoff;
-            }
-            else if (c == PAGE_DOWN) {
-                E.cy = E.rowoff + E.row - 1;
-                if (E.cy > E.numrows) {
-                    E.cy = E.numrows;
-                }
+            if (E.wrap) {
+                editor_wrap_page(-E.row);
+                break;
             }
-            int times = E.row;
-            while (times--) {
-                editor_move_cursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+            editor_jump(E.rowoff > E.row ? E.rowoff - E.row : 0, E.cx, 0);
+            break;
+        case PAGE_DOWN:
+            if (E.wrap) {
+                editor_wrap_page(2 * E.row - 1);
+                break;
             }
-        }
-                        break; // Uncrustify formats this code section a little awkwardly
+            editor_jump(E.rowoff + 2 * E.row - 1 < E.numrows ? E.rowoff + 2 * E.row - 1 : E.numrows, E.cx, 0);
+            break;
         case ARROW_UP:
         case ARROW_DOWN:
         case ARROW_LEFT:
@@ -205,6 +417,8 @@ void editor_process_keypress() {
             editor_move_cursor(c);
             break;
         case CTRL_KEY('l'):
+            E.screen.valid = 0; // Repaint everything
+            break;
         case '\x1b':
             break;
         default:
@@ -214,6 +428,52 @@ void editor_process_keypress() {
     quit_times = TEDITOR_QUIT_TIMES;
 } /* editor_process_keypress */
 
+/**
+ * Handles keypresses until it is time for the next frame: everything that
+ * is already waiting is handled without redrawing in between, and more input
+ * is waited for until E.frame_ms has passed since the last frame. Returns
+ * once input goes idle with the frame due, so the final state always gets
+ * drawn, or after a second frame interval of nonstop input. With no cap
+ * only the input already waiting is handled before the next frame
+ */
+void editor_process_input() {
+    long due = editor_now_ms() + E.frame_ms;
+
+    editor_process_keypress();
+    if (E.frame_ms == 0) {
+        while (editor_input_wait(0)) {
+            editor_process_keypress();
+        }
+        return;
+    }
+    while (1) {
+        long now = editor_now_ms();
+        if (now >= due + E.frame_ms || !editor_input_wait(now < due ? due - now : 0)) {
+            return;
+        }
+        editor_process_keypress();
+    }
+}
+
+/**
+ * Prompts for a new tab stop, every row gets rendered again with it
+ */
+void editor_set_tab_stop() {
+    char * input = editor_prompt("Tab stop: %s (ESC to cancel)", NULL);
+
+    if (input == NULL) {
+        return;
+    }
+    int tab_stop = atoi(input);
+    if (tab_stop < 1 || tab_stop > 64) {
+        editor_set_status_message("Invalid tab stop: %s", input);
+    }
+    else {
+        E.tab_stop = tab_stop; // Rows notice when they are next looked at, see editor_row_rendered()
+    }
+    free(input);
+}
+
 /**
  * Displays a prompt in the status bar, and lets the user input a line
  * of text after the prompt, acts as a 'save as' if the user did not
@@ -271,111 +531,136 @@ char * editor_prompt(char * prompt, void (*callback)(char *, int)) {
 ********************************/
 
 /**
- * Clears the screen and repositions the cursor
+ * Draws the next frame and sends the terminal what changed since the last
+ * one, then repositions the cursor
  */
 void editor_refresh_screen() {
+    if (E.resized) {
+        editor_handle_resize();
+    }
     editor_scroll();
+    editor_pager_evict();
+    screen_resize(E.row + 2, E.col);
 
-    struct abuf ab = ABUF_INIT;
+    editor_draw_rows();
+    editor_draw_status_bar();
+    editor_draw_message_bar();
 
-    ab_append(&ab, "\x1b[?25l", 6); // Hide the cursor during repainting
-    ab_append(&ab, "\x1b[H", 3);    // Reposition the cursor
-
-    editor_draw_rows(&ab);
-    editor_draw_status_bar(&ab);
-    editor_draw_message_bar(&ab);
+    struct abuf * ab = &E.screen.out;
+    ab_reset(ab);
+    ab_append(ab, "\x1b[?25l", 6); // Hide the cursor during repainting
+    int delta = E.rowoff - E.screen.rowoff;
+    if (E.wrap) { // In visual rows, a far jump is just repainted
+        delta = (E.rowoff > E.screen.rowoff || (E.rowoff == E.screen.rowoff && E.wrapoff >= E.screen.wrapoff)) ?
+          editor_wrap_distance(E.screen.rowoff, E.screen.wrapoff, E.rowoff, E.wrapoff, E.row) :
+          -editor_wrap_distance(E.rowoff, E.wrapoff, E.screen.rowoff, E.screen.wrapoff, E.row);
+    }
+    screen_scroll(ab, E.row, delta);
+    screen_flush(ab);
+    E.screen.rowoff  = E.rowoff;
+    E.screen.wrapoff = E.wrapoff;
 
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-    ab_append(&ab, buf, strlen(buf));
+    int y   = E.wrap ? E.wrap_y : E.cy - E.rowoff;
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, (E.rx - E.coloff) + 1);
+    ab_append(ab, buf, len);
 
-    ab_append(&ab, "\x1b[?25h", 6); // Show the cursor after repainting
-    write(STDOUT_FILENO, ab.b, ab.len);
-    ab_free(&ab);
+    ab_append(ab, "\x1b[?25h", 6); // Show the cursor after repainting
+    write(STDOUT_FILENO, ab->b, ab->len);
+    E.screen.frame_bytes  = ab->len;
+    E.screen.total_bytes += ab->len;
+    E.screen.frames++;
 }
 
 /**
  * Fills in text and any blank lines with a tilda
  */
-void editor_draw_rows(struct abuf * ab) {
-    for (int i = 0; i < E.row; i++) {
-        int filerow = i + E.rowoff;
+void editor_draw_rows() {
+    int filerow = E.rowoff;
+    int seg     = E.wrap ? E.wrapoff : 0;
+
+    for (int y = 0; y < E.row; y++) {
         if (filerow >= E.numrows) {
-            if (E.numrows == 0 && i == E.row / 3) { // Print welcome message if no filename is given
+            screen_put(y, 0, "~", 1, HL_NORMAL);
+            if (E.numrows == 0 && y == E.row / 3) { // Print welcome message if no filename is given
                 char welcome[80];
                 int len_welcome = snprintf(welcome, sizeof(welcome), "Teditor -- version %s", TEDITOR_VERSION);
                 if (len_welcome > E.col) {
                     len_welcome = E.col;
                 }
                 int padding = (E.col - len_welcome) / 2;
-                if (padding) {
-                    ab_append(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--) {
-                    ab_append(ab, " ", 1);
-                }
-                ab_append(ab, welcome, len_welcome);
+                screen_put(y, padding, welcome, len_welcome, HL_NORMAL);
             }
-            else {
-                ab_append(ab, "~", 1);
+        }
+        else if (E.wrap) {
+            erow * row = editor_row_at(filerow);
+            int b = editor_row_wrap_start(row, seg);
+            editor_draw_row(y, row, b, row->chunks ? editor_row_rbyte_to_rx(row, b) - seg * E.col : 0);
+            if (++seg < editor_row_wrap(row)) {
+                continue; // The line goes on on the next screen line
             }
         }
         else {
-            int len = E.editor_row[filerow].rsize - E.coloff;
-            if (len < 0) {
-                len = 0;
-            }
-            if (len > E.col) {
-                len = E.col;
-            }
-            char * c = &E.editor_row[filerow].render[E.coloff];
-            unsigned char * hl = &E.editor_row[filerow].hl[E.coloff];
-            int current_color  = -1; // Default text color
-            for (int i = 0; i < len; i++) {
-                if (iscntrl(c[i])) {
-                    char sym = (c[i] <= 26) ? '@' + c[i] : '?';
-                    ab_append(ab, "\x1b[7m", 4);
-                    ab_append(ab, &sym, 1);
-                    ab_append(ab, "\x1b[m", 3);
-                    if (current_color != -1) {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                        ab_append(ab, buf, clen);
-                    }
-                }
-                else if (hl[i] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        ab_append(ab, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    ab_append(ab, &c[i], 1);
-                }
-                else {
-                    int color = editor_syntax_to_color(hl[i]);
-                    if (color != current_color) {
-                        current_color = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        ab_append(ab, buf, clen);
-                    }
-                    ab_append(ab, &c[i], 1);
-                }
-            }
-            ab_append(ab, "\x1b[39m", 5);
+            erow * row = editor_row_at(filerow);
+            int b = editor_row_rx_to_rbyte(row, E.coloff);
+            editor_draw_row(y, row, b, editor_row_rbyte_to_rx(row, b) - E.coloff);
         }
-        ab_append(ab, "\x1b[K", 3); // Erase in display by line
-        ab_append(ab, "\r\n", 2);
+        filerow++;
+        seg = 0;
     }
 } /* editor_draw_rows */
 
+/**
+ * Draws row on screen line y from render index b on, which lands on column
+ * x, below 0 if a wide character straddles the left edge, until either the
+ * row or the line runs out
+ */
+void editor_draw_row(int y, erow * row, int b, int x) {
+    editor_prepare_row(row);
+    char * c = row->render;
+    unsigned char * hl = row->hl;
+    while (b < row->rsize && x < E.col) {
+        int run = (x < 0) ? 0 : screen_run(&c[b], &hl[b], (row->rsize - b < E.col - x) ? row->rsize - b : E.col - x);
+        if (run > 0) {
+            screen_put(y, x, &c[b], run, hl[b]);
+            b += run;
+            x += run;
+            continue;
+        }
+        if ((unsigned char)c[b] < 0x80) { // A control character
+            char sym = (c[b] <= 26) ? '@' + c[b] : '?';
+            screen_put(y, x++, &sym, 1, CELL_INVERSE);
+            b++;
+            continue;
+        }
+        unsigned int cp;
+        int len   = utf8_decode(&c[b], row->rsize - b, &cp);
+        int width = utf8_width(cp);
+        if (x < 0 || (width == 2 && x + 1 == E.col)) {
+            // Only half of it would fit, leave it blank
+        }
+        else if (cp == UTF8_INVALID || cp < 0xa0) { // Not UTF-8, or a C1 control character
+            screen_put(y, x, "?", 1, CELL_INVERSE);
+        }
+        else if (width > 0) {
+            screen_put_utf8(y, x, &c[b], len, width, hl[b]);
+        }
+        b += len;
+        x += width;
+    }
+}
+
 /**
  * Makes scrolling possible in editor
  */
 void editor_scroll() {
     E.rx = 0;
     if (E.cy < E.numrows) {
-        E.rx = editor_row_cx_to_rx(&E.editor_row[E.cy], E.cx);
+        E.rx = editor_row_cx_to_rx(editor_row_at(E.cy), E.cx);
+    }
+    if (E.wrap) {
+        editor_wrap_scroll();
+        return;
     }
 
     // Vertical scrolling
@@ -386,10 +671,10 @@ void editor_scroll() {
         E.rowoff = E.cy - E.row + 1;
     }
     // Horizontal scrolling
-    if (E.cx < E.coloff) {
+    if (E.rx < E.coloff) {
         E.coloff = E.rx;
     }
-    if (E.cx >= E.coloff + E.col) {
+    if (E.rx >= E.coloff + E.col) {
         E.coloff = E.rx - E.col + 1;
     }
 }
@@ -398,29 +683,22 @@ void editor_scroll() {
  * Display the status of a file at the bottom of the screen,
  * includes filename and line count
  */
-void editor_draw_status_bar(struct abuf * ab) {
-    ab_append(ab, "\x1b[7m", 4);
+void editor_draw_status_bar() {
     char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-        E.filename ? E.filename : "[No Name]", E.numrows, E.dirty ? "(modified)" : "");
+    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s%s",
+        E.filename ? E.filename : "[No Name]", E.numrows, E.pager ? "[pager] " : "", E.dirty ? "(modified)" : "");
     int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
         E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
     if (len > E.col) {
         len = E.col;
     }
-    ab_append(ab, status, len);
-    while (len < E.col) {
-        if (E.col - len == rlen) {
-            ab_append(ab, rstatus, rlen);
-            break;
-        }
-        else {
-            ab_append(ab, " ", 1);
-            len++;
-        }
+    for (int x = 0; x < E.col; x++) {
+        screen_put(E.row, x, " ", 1, CELL_INVERSE);
+    }
+    screen_put(E.row, 0, status, len, CELL_INVERSE);
+    if (len + rlen <= E.col) {
+        screen_put(E.row, E.col - rlen, rstatus, rlen, CELL_INVERSE);
     }
-    ab_append(ab, "\x1b[m", 3);
-    ab_append(ab, "\r\n", 2);
 }
 
 /**
@@ -438,581 +716,4758 @@ void editor_set_status_message(const char * fmt, ...) {
 /**
  * Create the message bar to display
  */
-void editor_draw_message_bar(struct abuf * ab) {
-    ab_append(ab, "\x1b[K", 3);
+void editor_draw_message_bar() {
     int msglen = strlen(E.statusmsg);
     if (msglen > E.col) {
         msglen = E.col;
     }
     if (msglen && time(NULL) - E.statusmsg_time < 5) {
-        ab_append(ab, E.statusmsg, msglen);
+        screen_put(E.row + 1, 0, E.statusmsg, msglen, HL_NORMAL);
     }
 }
 
 /********************************
-* Append Buffer
+* Screen
 ********************************/
 
+/*
+ * The draw functions above fill in the back frame, a grid of character and
+ * attribute cells, and screen_flush() then compares it with the front
+ * frame, what the terminal already shows. Only the stretch of each line
+ * between its first and last changed cells goes out, after a cursor
+ * addressing sequence, and a line whose tail turned blank is cut short with
+ * an erase to end of line. Typing a character thus sends a handful of bytes
+ * instead of the whole screen.
+ *
+ * Characters and attributes are kept in separate arrays so that both ends
+ * work on runs rather than cells: drawing copies each run of text sharing
+ * a highlight class in one go, and flushing sends each run of cells
+ * sharing an attribute as a single append after its precomputed escape.
+ * Runs are found RUN_SCAN_WIDTH bytes at a time with SSE2/AVX2 compares.
+ * Multibyte characters take the slow path: their cells are flagged
+ * CELL_UTF8 and keep their bytes in seq, and the right half of a wide one
+ * is a CELL_CONT cell that is never sent by itself.
+ *
+ * Vertical scrolling by less than a screen has the terminal move the text
+ * itself: screen_scroll() limits scrolling to the text area with DECSTBM,
+ * scrolls it with CSI S or T, and shifts the front frame the same way, so
+ * the flush only has to fill in the rows that were exposed.
+ */
+
 /**
- * Dynamic string support, allows string in struct ab to be appended
+ * Makes the frames rows by cols, a new size repaints everything; also
+ * clears the back frame for the next frame to be drawn on
  */
-void ab_append(struct abuf * ab, const char * s, int len) {
-    char * new = realloc(ab->b, ab->len + len);
+void screen_resize(int rows, int cols) {
+    if (rows != E.screen.rows || cols != E.screen.cols) {
+        struct screen_frame * frames[] = { &E.screen.front, &E.screen.back };
+        for (int i = 0; i < 2; i++) {
+            free(frames[i]->ch);
+            free(frames[i]->attr);
+            free(frames[i]->seq);
+            frames[i]->ch   = malloc(rows * cols);
+            frames[i]->attr = malloc(rows * cols);
+            frames[i]->seq  = malloc(sizeof(unsigned int) * rows * cols);
+        }
+        if (E.screen.rows == 0) {
+            screen_sgr_init();
+        }
+        E.screen.rows  = rows;
+        E.screen.cols  = cols;
+        E.screen.valid = 0;
+    }
+    memset(E.screen.back.ch, ' ', rows * cols);
+    memset(E.screen.back.attr, HL_NORMAL, rows * cols);
+}
 
-    if (new == NULL) {
+/**
+ * Draws len characters with attribute attr on the back frame at line y,
+ * column x, clipping whatever falls off the screen
+ */
+void screen_put(int y, int x, const char * s, int len, unsigned char attr) {
+    if (y < 0 || y >= E.screen.rows || x >= E.screen.cols) {
         return;
     }
-    memcpy(&new[ab->len], s, len);
-    ab->b    = new;
-    ab->len += len;
+    if (len > E.screen.cols - x) {
+        len = E.screen.cols - x;
+    }
+    memcpy(&E.screen.back.ch[y * E.screen.cols + x], s, len);
+    memset(&E.screen.back.attr[y * E.screen.cols + x], attr, len);
 }
 
 /**
- * Frees the struct ab
+ * Draws a multibyte character of width columns on the back frame, unless it
+ * doesn't fit entirely
  */
-void ab_free(struct abuf * ab) {
-    free(ab->b);
+void screen_put_utf8(int y, int x, const char * s, int len, int width, unsigned char attr) {
+    if (y < 0 || y >= E.screen.rows || x + width > E.screen.cols) {
+        return;
+    }
+    int at = y * E.screen.cols + x;
+    E.screen.back.ch[at]   = s[0];
+    E.screen.back.attr[at] = attr | CELL_UTF8;
+    E.screen.back.seq[at]  = 0;
+    memcpy(&E.screen.back.seq[at], s, len);
+    if (width == 2) {
+        E.screen.back.ch[at + 1]   = '\0';
+        E.screen.back.attr[at + 1] = attr | CELL_CONT;
+    }
 }
 
-/********************************
-* Row Operations
-********************************/
+/**
+ * Returns whether the cell at index at is the same on both frames
+ */
+int screen_same(int at) {
+    struct screen_frame * f = &E.screen.front;
+    struct screen_frame * b = &E.screen.back;
+
+    return f->ch[at] == b->ch[at] && f->attr[at] == b->attr[at] &&
+           (!(b->attr[at] & CELL_UTF8) || f->seq[at] == b->seq[at]);
+}
 
 /**
- * Allocates space for a new erow, then copies the string to new erow
+ * Precomputes the escapes switching the terminal to each attribute: the
+ * first table only sets the color, for when reverse video stays as it is,
+ * the second resets everything first
  */
-void editor_insert_row(int at, char * s, size_t len) {
-    if (at < 0 || at > E.numrows) {
-        return;
+void screen_sgr_init() {
+    for (int attr = 0; attr < CELL_ATTRS; attr++) {
+        int hl = attr & ~(CELL_INVERSE | CELL_UTF8 | CELL_CONT);
+        int fg = (hl == HL_NORMAL) ? 39 : editor_syntax_to_color(hl);
+        E.screen.sgr_len[0][attr] = snprintf(E.screen.sgr[0][attr], sizeof(E.screen.sgr[0][attr]),
+            "\x1b[%dm", fg);
+        E.screen.sgr_len[1][attr] = snprintf(E.screen.sgr[1][attr], sizeof(E.screen.sgr[1][attr]),
+            "\x1b[0;%s%dm", (attr & CELL_INVERSE) ? "7;" : "", fg);
     }
-    E.editor_row = realloc(E.editor_row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.editor_row[at + 1], &E.editor_row[at], sizeof(erow) * (E.numrows - at));
-    E.editor_row[at].idx = at;
+}
 
-    E.editor_row[at].size  = len;
-    E.editor_row[at].chars = malloc(len + 1);
-    memcpy(E.editor_row[at].chars, s, len);
-    E.editor_row[at].chars[len] = '\0';
+/**
+ * Appends the escape switching the terminal from one cell attribute to another
+ */
+void screen_sgr(struct abuf * ab, int from, int to) {
+    int reset = ((from ^ to) & CELL_INVERSE) != 0;
 
-    E.editor_row[at].rsize  = 0;
-    E.editor_row[at].render = NULL;
-    E.editor_row[at].hl     = NULL;
-    E.editor_row[at].hl_open_comment = 0;
-    editor_update_row(&E.editor_row[at]);
+    ab_append(ab, E.screen.sgr[reset][to], E.screen.sgr_len[reset][to]);
+}
 
-    E.numrows++;
-    E.dirty++;
+/**
+ * Returns a bit mask of which of the RUN_SCAN_WIDTH bytes at hl equal h,
+ * leaving out control characters and non-ASCII bytes in c unless c is NULL
+ */
+unsigned int screen_run_mask(const char * c, const unsigned char * hl, unsigned char h) {
+#if defined(__AVX2__)
+    __m256i v    = _mm256_loadu_si256((const __m256i *)hl);
+    __m256i same = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(h));
+    if (c) {
+        __m256i t    = _mm256_loadu_si256((const __m256i *)c);
+        __m256i low  = _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(31)), t);
+        __m256i del  = _mm256_cmpeq_epi8(t, _mm256_set1_epi8(127));
+        __m256i high = _mm256_cmpgt_epi8(_mm256_setzero_si256(), t);
+        same = _mm256_andnot_si256(_mm256_or_si256(_mm256_or_si256(low, del), high), same);
+    }
+    return _mm256_movemask_epi8(same);
+#elif defined(__SSE2__)
+    __m128i v    = _mm_loadu_si128((const __m128i *)hl);
+    __m128i same = _mm_cmpeq_epi8(v, _mm_set1_epi8(h));
+    if (c) {
+        __m128i t    = _mm_loadu_si128((const __m128i *)c);
+        __m128i low  = _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(31)), t);
+        __m128i del  = _mm_cmpeq_epi8(t, _mm_set1_epi8(127));
+        __m128i high = _mm_cmplt_epi8(t, _mm_setzero_si128());
+        same = _mm_andnot_si128(_mm_or_si128(_mm_or_si128(low, del), high), same);
+    }
+    return _mm_movemask_epi8(same);
+#else
+    unsigned int mask = 0;
+    for (int i = 0; i < RUN_SCAN_WIDTH; i++) {
+        int ctrl = c && ((unsigned char)c[i] < 32 || (unsigned char)c[i] >= 127);
+        mask |= (unsigned int)(hl[i] == h && !ctrl) << i;
+    }
+    return mask;
+#endif
 }
 
 /**
- * Uses the chars string of an erow to fill in the contents of the render string,
- * replaces any tabs with spaces
+ * Returns how many of the len bytes at hl share the class of the first
+ * one, stopping early at control characters and non-ASCII bytes in c
+ * unless c is NULL
  */
-void editor_update_row(erow * row) {
-    int tabs = 0;
+int screen_run(const char * c, const unsigned char * hl, int len) {
+    unsigned int full = (RUN_SCAN_WIDTH == 32) ? ~0u : (1u << RUN_SCAN_WIDTH) - 1;
+    int i = 0;
 
-    for (int i = 0; i < row->size; i++) {
-        if (row->chars[i] == '\t') {
-            tabs++;
+    for ( ; i + RUN_SCAN_WIDTH <= len; i += RUN_SCAN_WIDTH) {
+        unsigned int mask = screen_run_mask(c ? &c[i] : NULL, &hl[i], hl[0]);
+        if (mask != full) {
+            return i + __builtin_ctz(~mask);
         }
     }
-    free(row->render);
-    row->render = malloc(row->size + (tabs * (TEDITOR_TAB_STOP - 1)) + 1);
-    int idx = 0;
-    for (int i = 0; i < row->size; i++) {
-        if (row->chars[i] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % TEDITOR_TAB_STOP != 0) {
-                row->render[idx++] = ' ';
-            }
-        }
-        else {
-            row->render[idx++] = row->chars[i];
-        }
+    while (i < len && hl[i] == hl[0] && !(c && ((unsigned char)c[i] < 32 || (unsigned char)c[i] >= 127))) {
+        i++;
     }
-    row->render[idx] = '\0';
-    row->rsize       = idx;
-    editor_update_syntax(row);
+    return i;
 }
 
 /**
- * Calculates the value of rx in editor_scroll
+ * Scrolls the first rows lines of the terminal by delta lines, up if delta
+ * is positive, down if it is negative, and the front frame along with them
  */
-int editor_row_cx_to_rx(erow * row, int cx) {
-    int rx = 0;
+void screen_scroll(struct abuf * ab, int rows, int delta) {
+    int n = delta > 0 ? delta : -delta;
 
-    for (int i = 0; i < cx; i++) {
-        if (row->chars[i] == '\t') {
-            rx += (TEDITOR_TAB_STOP - 1) - (rx % TEDITOR_TAB_STOP);
-        }
-        rx++;
+    if (!E.screen.valid || n == 0 || n >= rows || rows > E.screen.rows) {
+        return;
     }
-    return rx;
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r", rows, n, delta > 0 ? 'S' : 'T');
+    ab_append(ab, buf, len);
+
+    int cols    = E.screen.cols;
+    int keep    = (rows - n) * cols;
+    int exposed = (delta > 0) ? keep : 0; // Offset of the rows that scrolled in blank
+    int from    = (delta > 0) ? n * cols : 0;
+    int to      = (delta > 0) ? 0 : n * cols;
+    memmove(&E.screen.front.ch[to], &E.screen.front.ch[from], keep);
+    memmove(&E.screen.front.attr[to], &E.screen.front.attr[from], keep);
+    memmove(&E.screen.front.seq[to], &E.screen.front.seq[from], sizeof(unsigned int) * keep);
+    memset(&E.screen.front.ch[exposed], ' ', n * cols);
+    memset(&E.screen.front.attr[exposed], HL_NORMAL, n * cols);
 }
 
 /**
- * Converts the render index into a chars index
+ * Appends what it takes to turn the front frame into the back frame, and
+ * swaps them
  */
-int editor_row_rx_to_cx(erow * row, int rx) {
-    int cur_rx = 0;
-    int i;
+void screen_flush(struct abuf * ab) {
+    int cols  = E.screen.cols;
+    int attr  = HL_NORMAL; // Every flush leaves the terminal with plain attributes
 
-    for (i = 0; i < row->size; i++) {
-        if (row->chars[i] == '\t') {
-            cur_rx += (TEDITOR_TAB_STOP - 1) - (cur_rx % TEDITOR_TAB_STOP);
+    for (int y = 0; y < E.screen.rows; y++) {
+        char * fch = &E.screen.front.ch[y * cols];
+        char * bch = &E.screen.back.ch[y * cols];
+        unsigned char * fattr = &E.screen.front.attr[y * cols];
+        unsigned char * battr = &E.screen.back.attr[y * cols];
+        unsigned int * fseq   = &E.screen.front.seq[y * cols];
+        unsigned int * bseq   = &E.screen.back.seq[y * cols];
+        int first = 0;
+        int last  = cols - 1;
+        if (E.screen.valid) {
+            if (memcmp(fch, bch, cols) == 0 && memcmp(fattr, battr, cols) == 0) {
+                int same = 1;
+                for (int i = 0; i < cols && same; i++) {
+                    same = !(battr[i] & CELL_UTF8) || fseq[i] == bseq[i];
+                }
+                if (same) {
+                    continue;
+                }
+            }
+            while (screen_same(y * cols + first)) {
+                first++;
+            }
+            while (screen_same(y * cols + last)) {
+                last--;
+            }
+            // Wide characters are drawn whole, and overwriting half of one
+            // on the terminal blanks the other half
+            while (first > 0 && ((fattr[first] | battr[first]) & CELL_CONT)) {
+                first--;
+            }
+            while (last < cols - 1 && ((fattr[last + 1] | battr[last + 1]) & CELL_CONT)) {
+                last++;
+            }
+        }
+        int end = cols; // Everything from end on is blank
+        while (end > 0 && bch[end - 1] == ' ' && battr[end - 1] == HL_NORMAL) {
+            end--;
         }
-        cur_rx++;
-        if (cur_rx > rx) {
-            return i;
+        char buf[32];
+        int x   = first < end ? first : end;
+        int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+        ab_append(ab, buf, len);
+        int stop = (last < end) ? last + 1 : end;
+        while (x < stop) {
+            int run   = screen_run(NULL, &battr[x], stop - x);
+            int style = battr[x] & CELL_STYLE;
+            if (style != attr) {
+                screen_sgr(ab, attr, style);
+                attr = style;
+            }
+            if (battr[x] & CELL_UTF8) {
+                if (ab_reserve(ab, 4 * run) == 0) { // Each seq holds up to 4 bytes
+                    for (int i = x; i < x + run; i++) {
+                        memcpy(&ab->b[ab->len], &bseq[i], 4);
+                        ab->len += utf8_length(bch[i]);
+                    }
+                }
+            }
+            else if (!(battr[x] & CELL_CONT)) {
+                ab_append(ab, &bch[x], run);
+            }
+            x += run;
+        }
+        if (last >= end) {
+            if (attr != HL_NORMAL) {
+                attr = HL_NORMAL;
+                ab_append(ab, "\x1b[m", 3);
+            }
+            ab_append(ab, "\x1b[K", 3); // Erase in display by line
         }
     }
-    return i;
-}
+    if (attr != HL_NORMAL) {
+        ab_append(ab, "\x1b[m", 3);
+    }
+    struct screen_frame front = E.screen.front;
+    E.screen.front = E.screen.back;
+    E.screen.back  = front;
+    E.screen.valid = 1;
+} /* screen_flush */
+
+/********************************
+* Append Buffer
+********************************/
+
+/*
+ * The buffer doubles whenever it runs out of room, so a frame costs a few
+ * reallocs at most, and the screen keeps its buffer from frame to frame, so
+ * once it has grown to the size of a frame it never reallocs again.
+ */
 
 /**
- * Inserts a single character into an erow at a given position
+ * Makes room for len more bytes, returns -1 if that can't be done
  */
-void editor_row_insert_char(erow * row, int at, int c) {
-    if (at < 0 || at > row->size) {
-        at = row->size;
+int ab_reserve(struct abuf * ab, int len) {
+    if (ab->len + len <= ab->cap) {
+        return 0;
     }
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editor_update_row(row);
-    E.dirty++;
+    int cap = ab->cap ? ab->cap : ABUF_MIN_SIZE;
+    while (cap < ab->len + len) {
+        cap *= 2;
+    }
+    char * new = realloc(ab->b, cap);
+    if (new == NULL) {
+        return -1;
+    }
+    ab->b   = new;
+    ab->cap = cap;
+    return 0;
 }
 
 /**
- * Allows the deletion of characters from erow
+ * Dynamic string support, allows string in struct ab to be appended
  */
-void editor_row_del_char(erow * row, int at) {
-    if (at < 0 || at >= row->size) {
+void ab_append(struct abuf * ab, const char * s, int len) {
+    if (ab_reserve(ab, len) == -1) {
         return;
     }
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editor_update_row(row);
-    E.dirty++;
+    memcpy(&ab->b[ab->len], s, len);
+    ab->len += len;
 }
 
 /**
- * Removes and frees row from erow
+ * Appends a single byte, for the common case of emitting one cell
  */
-void editor_free_row(erow * row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+void ab_putc(struct abuf * ab, char c) {
+    if (ab->len < ab->cap || ab_reserve(ab, 1) == 0) {
+        ab->b[ab->len++] = c;
+    }
 }
 
 /**
- * Deletes a row
+ * Empties the struct ab but keeps its memory for reuse
  */
-void editor_del_row(int at) {
-    if (at < 0 || at >= E.numrows) {
-        return;
-    }
-    editor_free_row(&E.editor_row[at]);
-    memmove(&E.editor_row[at], &E.editor_row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    for (int i = at; i < E.numrows - 1; i++) {
-        E.editor_row[i].idx--;
-    }
-    E.numrows--;
-    E.dirty++;
+void ab_reset(struct abuf * ab) {
+    ab->len = 0;
 }
 
 /**
- * Appends a string to the end of a row
+ * Frees the struct ab
  */
-void editor_row_append_string(erow * row, char * s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editor_update_row(row);
-    E.dirty++;
+void ab_free(struct abuf * ab) {
+    free(ab->b);
+    ab->b   = NULL;
+    ab->len = 0;
+    ab->cap = 0;
 }
 
 /********************************
-* Editor Operations
+* Row Pool
 ********************************/
 
+/*
+ * Row nodes and their chars, render and hl strings are carved out of 64 KB
+ * slabs, one set of slabs per power-of-two size class. Freed blocks go on a
+ * per-class free list for reuse, and closing a buffer hands every slab back
+ * at once instead of freeing millions of small strings one by one. Blocks
+ * bigger than the largest class go straight to malloc.
+ */
+
 /**
- * Insert character into the position the cursor is at
+ * Returns the size class a block of size bytes is served from,
+ * or -1 if it is too big for the pool
  */
-void editor_insert_char(int c) {
-    if (E.cy == E.numrows) {
-        editor_insert_row(E.numrows, "", 0);
+int pool_class(size_t size) {
+    int cls     = 0;
+    size_t csize = POOL_MIN_SIZE;
+
+    if (size > POOL_MAX_SIZE) {
+        return -1;
     }
-    editor_row_insert_char(&E.editor_row[E.cy], E.cx, c);
-    E.cx++;
+    while (csize < size) {
+        csize <<= 1;
+        cls++;
+    }
+    return cls;
 }
 
 /**
- * Deletes the character that is to the left of the cursor
+ * Allocates a block of at least size bytes
  */
-void editor_del_char() {
-    if (E.cy == E.numrows) {
-        return;
-    }
-    if (E.cx == 0 && E.cy == 0) {
-        return;
+void * pool_alloc(size_t size) {
+    int cls = pool_class(size);
+
+    if (cls == -1) {
+        return malloc(size);
     }
-    erow * row = &E.editor_row[E.cy];
-    if (E.cx > 0) {
-        editor_row_del_char(row, E.cx - 1);
-        E.cx--;
+    void * p = E.pool.free_list[cls];
+    if (p) {
+        E.pool.free_list[cls] = *(void **)p;
+        E.pool.saved++;
+        return p;
     }
-    else {
-        E.cx = E.editor_row[E.cy - 1].size;
-        editor_row_append_string(&E.editor_row[E.cy - 1], row->chars, row->size);
-        editor_del_row(E.cy);
-        E.cy--;
+    size_t csize = (size_t)POOL_MIN_SIZE << cls;
+    if (E.pool.next[cls] == NULL || E.pool.end[cls] - E.pool.next[cls] < (long)csize) {
+        struct pool_slab * slab = malloc(POOL_SLAB_SIZE);
+        if (slab == NULL) {
+            return NULL;
+        }
+        slab->next     = E.pool.slabs;
+        E.pool.slabs   = slab;
+        E.pool.next[cls] = (char *)slab + POOL_MIN_SIZE; // Skip the header, keeps blocks aligned
+        E.pool.end[cls]  = (char *)slab + POOL_SLAB_SIZE;
+        E.pool.saved--;
     }
+    p = E.pool.next[cls];
+    E.pool.next[cls] += csize;
+    E.pool.saved++;
+    return p;
 }
 
 /**
- * Inserts a new line into the position the cursor is at,
- * if there is text to the right of the cursor, move it to the next row
+ * Returns a block of size bytes, as passed to pool_alloc(), to the pool
  */
-void editor_insert_newline() {
-    if (E.cx == 0) {
-        editor_insert_row(E.cy, "", 0);
+void pool_free(void * p, size_t size) {
+    int cls = pool_class(size);
+
+    if (p == NULL) {
+        return;
     }
-    else {
-        erow * row = &E.editor_row[E.cy];
-        editor_insert_row(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row       = &E.editor_row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editor_update_row(row);
+    if (cls == -1) {
+        free(p);
+        return;
     }
-    E.cy++;
-    E.cx = 0;
+    *(void **)p = E.pool.free_list[cls];
+    E.pool.free_list[cls] = p;
 }
 
-/********************************
-* Find
-********************************/
-
 /**
- * Method for a basic search feature
+ * Resizes a block from old_size to size bytes, keeping its contents
  */
-void editor_find() {
-    int saved_cx     = E.cx;
-    int saved_cy     = E.cy;
-    int saved_coloff = E.coloff;
-    int saved_rowoff = E.rowoff;
-    char * query     = editor_prompt("Search: %s (ESC/Enter to cancel)", editor_find_callback);
+void * pool_realloc(void * p, size_t old_size, size_t size) {
+    int old_cls = pool_class(old_size);
+    int cls     = pool_class(size);
 
-    if (query) {
-        free(query);
+    if (p == NULL) {
+        return pool_alloc(size);
+    }
+    if (old_cls == -1 && cls == -1) {
+        return realloc(p, size);
+    }
+    if (old_cls == cls) {
+        return p;
+    }
+    void * new = pool_alloc(size);
+    if (new == NULL) {
+        return NULL;
+    }
+    memcpy(new, p, old_size < size ? old_size : size);
+    pool_free(p, old_size);
+    return new;
+}
+
+/**
+ * Frees every slab at once, invalidating all pooled blocks
+ */
+void pool_release() {
+    while (E.pool.slabs) {
+        struct pool_slab * slab = E.pool.slabs;
+        E.pool.slabs = slab->next;
+        free(slab);
+    }
+    for (int cls = 0; cls < POOL_CLASSES; cls++) {
+        E.pool.next[cls]      = NULL;
+        E.pool.end[cls]       = NULL;
+        E.pool.free_list[cls] = NULL;
+    }
+}
+
+/********************************
+* Row Tree
+********************************/
+
+/*
+ * Rows are kept in an implicit treap ordered by position: every node stores
+ * the number of rows in its subtree, so finding, inserting and deleting the
+ * row at a given index takes O(log n) instead of shifting a flat array.
+ * Nodes never move in memory, so an erow pointer stays valid until the row
+ * itself is deleted.
+ *
+ * A node is either a row or a span: a run of lines of the mapped file that
+ * nobody has looked at yet (ROW_SPAN). Counts are in lines, so a span stands
+ * for all of its lines at once, and opening a file creates a single node.
+ * editor_row_at() and friends split spans on demand and only ever hand out
+ * rows; the row_tree_first/next/prev() walks visit spans as they are.
+ */
+
+/**
+ * Returns the row at index at, or NULL if at is out of range
+ */
+erow * editor_row_at(int at) {
+    int offset;
+
+    if (at < 0 || at >= E.numrows) {
+        return NULL;
+    }
+    erow * t = row_tree_find(at, &offset);
+    if (t->flags & ROW_SPAN) {
+        row_tree_isolate(at);
+        row_tree_isolate(at + 1);
+        t = row_tree_find(at, &offset);
+        editor_span_to_row(t);
+    }
+    return t;
+}
+
+/**
+ * Returns the index of a row by walking up to the root of the tree
+ */
+int editor_row_index(erow * row) {
+    int idx = row_tree_count(row->left);
+
+    while (row->parent) {
+        if (row == row->parent->right) {
+            idx += row_tree_count(row->parent->left) + row->parent->lines;
+        }
+        row = row->parent;
+    }
+    return idx;
+}
+
+/**
+ * Returns the row following row, or NULL if row is the last one
+ */
+erow * editor_row_next(erow * row) {
+    erow * next = row_tree_next(row);
+
+    if (next && (next->flags & ROW_SPAN)) {
+        next = editor_row_at(editor_row_index(next));
+    }
+    return next;
+}
+
+/**
+ * Returns the row preceding row, or NULL if row is the first one
+ */
+erow * editor_row_prev(erow * row) {
+    erow * prev = row_tree_prev(row);
+
+    if (prev && (prev->flags & ROW_SPAN)) {
+        prev = editor_row_at(editor_row_index(prev) + prev->lines - 1);
+    }
+    return prev;
+}
+
+/**
+ * Returns the first node of the tree, row or span
+ */
+erow * row_tree_first() {
+    erow * t = E.editor_row;
+
+    while (t && t->left) {
+        t = t->left;
+    }
+    return t;
+}
+
+/**
+ * Returns the node following t, row or span
+ */
+erow * row_tree_next(erow * t) {
+    if (t->right) {
+        t = t->right;
+        while (t->left) {
+            t = t->left;
+        }
+        return t;
+    }
+    while (t->parent && t == t->parent->right) {
+        t = t->parent;
+    }
+    return t->parent;
+}
+
+/**
+ * Returns the node preceding t, row or span
+ */
+erow * row_tree_prev(erow * t) {
+    if (t->left) {
+        t = t->left;
+        while (t->right) {
+            t = t->right;
+        }
+        return t;
+    }
+    while (t->parent && t == t->parent->left) {
+        t = t->parent;
+    }
+    return t->parent;
+}
+
+/**
+ * Returns the node holding line at, and the offset of the line in it
+ */
+erow * row_tree_find(int at, int * offset) {
+    erow * t = E.editor_row;
+
+    while (t) {
+        int lcount = row_tree_count(t->left);
+        if (at < lcount) {
+            t = t->left;
+        }
+        else if (at < lcount + t->lines) {
+            *offset = at - lcount;
+            return t;
+        }
+        else {
+            at -= lcount + t->lines;
+            t   = t->right;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Splits the span holding line at, if any, so that a node starts at line at
+ */
+void row_tree_isolate(int at) {
+    int offset;
+    erow * t = row_tree_find(at, &offset);
+
+    if (t == NULL || offset == 0) {
+        return;
+    }
+    erow * rest = editor_new_span(t->span_first + offset, t->lines - offset);
+    t->lines = offset;
+    t->bytes = t->bytes - rest->bytes;
+    for (erow * p = t; p; p = p->parent) {
+        row_tree_update(p);
+    }
+    row_tree_link(rest, at);
+}
+
+/**
+ * Returns a pseudo-random treap priority (xorshift32)
+ */
+unsigned int row_tree_rand() {
+    static unsigned int seed = 2463534242u;
+
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+/**
+ * Returns the number of lines in a subtree
+ */
+int row_tree_count(erow * t) {
+    return t ? t->count : 0;
+}
+
+/**
+ * Returns the number of bytes in a subtree
+ */
+size_t row_tree_count_bytes(erow * t) {
+    return t ? t->count_bytes : 0;
+}
+
+/**
+ * Returns the bytes a node stands for: spans and mapped rows cover their
+ * lines as they are in the file, line terminators included, other rows
+ * their chars and the newline they are saved with
+ */
+size_t row_tree_bytes(erow * t) {
+    if (t->flags & (ROW_SPAN | ROW_MAPPED)) {
+        return editor_file_offset(t->span_first + t->lines) - editor_file_offset(t->span_first);
+    }
+    return t->size + 1;
+}
+
+/**
+ * Refreshes the byte count of a row whose size changed, and of every
+ * subtree holding it
+ */
+void row_tree_resize(erow * t) {
+    t->bytes = row_tree_bytes(t);
+    for (erow * p = t; p; p = p->parent) {
+        row_tree_update(p);
+    }
+}
+
+/**
+ * Returns the node holding byte off, with the line the node starts at and
+ * the offset of the byte in it, or NULL if off is past the end
+ */
+erow * row_tree_find_offset(size_t off, int * at, size_t * offset) {
+    erow * t = E.editor_row;
+
+    *at = 0;
+    while (t) {
+        size_t lbytes = row_tree_count_bytes(t->left);
+        if (off < lbytes) {
+            t = t->left;
+        }
+        else if (off < lbytes + t->bytes) {
+            *at    += row_tree_count(t->left);
+            *offset = off - lbytes;
+            return t;
+        }
+        else {
+            off -= lbytes + t->bytes;
+            *at += row_tree_count(t->left) + t->lines;
+            t    = t->right;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Recomputes the line and byte counts of a node and points its children
+ * back at it
+ */
+void row_tree_update(erow * t) {
+    t->count = t->lines + row_tree_count(t->left) + row_tree_count(t->right);
+    t->count_bytes = t->bytes + row_tree_count_bytes(t->left) + row_tree_count_bytes(t->right);
+    if (t->left) {
+        t->left->parent = t;
+    }
+    if (t->right) {
+        t->right->parent = t;
+    }
+}
+
+/**
+ * Joins two trees, every row of a ends up before every row of b
+ */
+erow * row_tree_merge(erow * a, erow * b) {
+    if (a == NULL) {
+        return b;
+    }
+    if (b == NULL) {
+        return a;
+    }
+    if (a->prio > b->prio) {
+        a->right = row_tree_merge(a->right, b);
+        row_tree_update(a);
+        return a;
+    }
+    b->left = row_tree_merge(a, b->left);
+    row_tree_update(b);
+    return b;
+}
+
+/**
+ * Splits a tree so that its first k lines end up in a and the rest in b,
+ * a node must start at line k, see row_tree_isolate()
+ */
+void row_tree_split(erow * t, int k, erow ** a, erow ** b) {
+    if (t == NULL) {
+        *a = NULL;
+        *b = NULL;
+        return;
+    }
+    if (row_tree_count(t->left) + t->lines <= k) {
+        row_tree_split(t->right, k - row_tree_count(t->left) - t->lines, &t->right, b);
+        row_tree_update(t);
+        *a = t;
+    }
+    else {
+        row_tree_split(t->left, k, a, &t->left);
+        row_tree_update(t);
+        *b = t;
+    }
+}
+
+/**
+ * Sifts the priority of a node down until both children have lower ones
+ */
+void row_tree_heapify(erow * t) {
+    while (1) {
+        erow * max = t;
+        if (t->left && t->left->prio > max->prio) {
+            max = t->left;
+        }
+        if (t->right && t->right->prio > max->prio) {
+            max = t->right;
+        }
+        if (max == t) {
+            return;
+        }
+        unsigned int prio = t->prio;
+        t->prio   = max->prio;
+        max->prio = prio;
+        t         = max;
+    }
+}
+
+/**
+ * Builds a balanced tree out of rows[lo, hi) in linear time
+ */
+erow * row_tree_build(erow ** rows, int lo, int hi) {
+    if (lo >= hi) {
+        return NULL;
+    }
+    int mid = lo + (hi - lo) / 2;
+    erow * t = rows[mid];
+    t->prio  = row_tree_rand();
+    t->left  = row_tree_build(rows, lo, mid);
+    t->right = row_tree_build(rows, mid + 1, hi);
+    row_tree_heapify(t);
+    row_tree_update(t);
+    return t;
+}
+
+/**
+ * Links a detached node into the tree so that it starts at line at,
+ * a node must already start there
+ */
+void row_tree_link(erow * node, int at) {
+    erow * a, * b;
+
+    node->left  = NULL;
+    node->right = NULL;
+    node->prio  = row_tree_rand();
+    row_tree_update(node);
+    row_tree_split(E.editor_row, at, &a, &b);
+    E.editor_row = row_tree_merge(row_tree_merge(a, node), b);
+    E.editor_row->parent = NULL;
+}
+
+/**
+ * Links a detached row into the tree so that it becomes row number at
+ */
+void row_tree_insert(erow * row, int at) {
+    row_tree_isolate(at);
+    row_tree_link(row, at);
+    E.numrows = row_tree_count(E.editor_row);
+}
+
+/**
+ * Unlinks the node starting at line at and standing for lines lines from the
+ * tree and returns it
+ */
+erow * row_tree_unlink(int at, int lines) {
+    erow * a, * b, * node;
+
+    row_tree_split(E.editor_row, at, &a, &b);
+    row_tree_split(b, lines, &node, &b);
+    E.editor_row = row_tree_merge(a, b);
+    if (E.editor_row) {
+        E.editor_row->parent = NULL;
+    }
+    E.numrows = row_tree_count(E.editor_row);
+    return node;
+}
+
+/**
+ * Unlinks row number at from the tree and returns it
+ */
+erow * row_tree_remove(int at) {
+    editor_row_at(at); // Turns line at into a row of its own
+    return row_tree_unlink(at, 1);
+}
+
+/**
+ * Appends n detached nodes to the end of the tree in linear time
+ */
+void row_tree_append(erow ** rows, int n) {
+    E.editor_row = row_tree_merge(E.editor_row, row_tree_build(rows, 0, n));
+    if (E.editor_row) {
+        E.editor_row->parent = NULL;
+    }
+    E.numrows = row_tree_count(E.editor_row);
+}
+
+/********************************
+* Row Operations
+********************************/
+
+/**
+ * Allocates a detached erow holding a copy of the string
+ */
+erow * editor_new_row(char * s, size_t len) {
+    erow * row = pool_alloc(sizeof(erow));
+
+    row->left   = NULL;
+    row->right  = NULL;
+    row->parent = NULL;
+    row->prio   = 0;
+    row->count  = 1;
+    row->lines  = 1;
+    row->count_bytes = len + 1;
+    row->bytes  = len + 1;
+    row->span_first = 0;
+    row->save_gen   = 0;
+    row->size   = len;
+    row->chars  = pool_alloc(len + 1);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+    row->gap_start  = len;
+    row->gap_len    = 0;
+
+    row->rsize  = 0;
+    row->render = NULL;
+    row->hl     = NULL;
+    row->tabs   = NULL;
+    row->ntabs  = 0;
+    row->colmap = NULL;
+    row->wraps  = NULL;
+    row->nwraps = 0;
+    row->wrap_cols = 0;
+    row->chunks    = NULL;
+    row->win_start = 0;
+    row->win_end   = 0;
+    row->win_col   = 0;
+    row->hl_end_state = HL_DFA_SEP;
+    row->flags  = 0;
+    return row;
+}
+
+/**
+ * Allocates a detached span standing for lines [first, first + lines) of
+ * the mapped file
+ */
+erow * editor_new_span(int first, int lines) {
+    erow * t = pool_alloc(sizeof(erow));
+
+    memset(t, 0, sizeof(erow));
+    t->count      = lines;
+    t->lines      = lines;
+    t->span_first = first;
+    t->flags      = ROW_SPAN;
+    t->bytes      = row_tree_bytes(t);
+    t->count_bytes = t->bytes;
+    return t;
+}
+
+/**
+ * Turns a one-line span into a row whose chars point straight into the
+ * mapped file, the line is only copied once it is edited
+ */
+void editor_span_to_row(erow * t) {
+    int len;
+
+    t->chars     = editor_file_line(t->span_first, &len);
+    t->size      = len;
+    t->gap_start = len;
+    t->gap_len   = 0;
+    t->rsize     = 0;
+    t->render    = NULL;
+    t->hl        = NULL;
+    t->tabs      = NULL;
+    t->ntabs     = 0;
+    t->colmap    = NULL;
+    t->wraps     = NULL;
+    t->nwraps    = 0;
+    t->wrap_cols = 0;
+    t->chunks    = NULL;
+    t->win_start = 0;
+    t->win_end   = 0;
+    t->win_col   = 0;
+    t->hl_end_state = HL_DFA_SEP;
+    t->flags     = ROW_MAPPED;
+    E.mapped_rows++;
+}
+
+/**
+ * Gives a row chars of its own so it can be edited: mapped rows get a copy
+ * of their line, rows shared with a running save a copy of their buffer
+ */
+void editor_row_own(erow * row) {
+    if (row->flags & ROW_MAPPED) {
+        editor_hl_worker_edited(editor_row_index(row));
+        char * chars = pool_alloc(row->size + 1);
+        memcpy(chars, row->chars, row->size);
+        chars[row->size] = '\0';
+        row->chars  = chars;
+        row->flags &= ~ROW_MAPPED;
+        E.mapped_rows--;
+        row_tree_resize(row); // The line terminator is now a plain \n
+    }
+    else if (editor_row_shared(row)) {
+        size_t size  = row->size + row->gap_len + 1;
+        char * chars = pool_alloc(size);
+        memcpy(chars, row->chars, size);
+        editor_save_defer(row->chars, size);
+        row->chars    = chars;
+        row->save_gen = 0;
+    }
+}
+
+/**
+ * Creates a new erow holding a copy of the string and links it in at index at
+ */
+void editor_insert_row(int at, char * s, size_t len) {
+    if (at < 0 || at > E.numrows) {
+        return;
+    }
+    erow * row = editor_new_row(s, len);
+    row_tree_insert(row, at);
+    editor_hl_worker_edited(at);
+    erow * next = editor_row_next(row);
+    if (next) { // The next row now follows a different row
+        editor_invalidate_row(next);
+    }
+    E.dirty++;
+}
+
+/*
+ * The chars of a row are kept as a gap buffer: the text before the cursor
+ * sits at the start of the allocation, the text after it at the end, and the
+ * free space in between absorbs inserts and deletes. Typing and deleting at
+ * the same spot only touch the edge of the gap, and the gap grows in
+ * proportion to the row, so edits cost O(1) amortized. Readers that only
+ * walk the row use ROW_CHAR(); editor_row_chars() closes the gap for the few
+ * that need a flat, NUL terminated string.
+ */
+
+/**
+ * Moves the gap to the end of the row and returns the row as a C string
+ */
+char * editor_row_chars(erow * row) {
+    editor_row_move_gap(row, row->size);
+    row->chars[row->size] = '\0';
+    return row->chars;
+}
+
+/**
+ * Moves the gap so that it starts right before chars index at, every edit
+ * goes through here first so this is also where mapped rows get copied
+ */
+void editor_row_move_gap(erow * row, int at) {
+    editor_row_own(row);
+    if (at < row->gap_start) {
+        memmove(&row->chars[at + row->gap_len], &row->chars[at], row->gap_start - at);
+    }
+    else if (at > row->gap_start) {
+        memmove(&row->chars[row->gap_start], &row->chars[row->gap_start + row->gap_len], at - row->gap_start);
+    }
+    row->gap_start = at;
+}
+
+/**
+ * Makes sure the gap can hold at least len more characters, growing the
+ * buffer geometrically so that repeated inserts stay cheap
+ */
+void editor_row_reserve(erow * row, int len) {
+    if (row->gap_len >= len) {
+        return;
+    }
+    int grow = row->size / 2;
+    if (grow < TEDITOR_GAP_MIN) {
+        grow = TEDITOR_GAP_MIN;
+    }
+    if (grow < len) {
+        grow = len;
+    }
+    int tail = row->size - row->gap_start;
+    row->chars = pool_realloc(row->chars, row->size + row->gap_len + 1, row->size + row->gap_len + grow + 1);
+    memmove(&row->chars[row->gap_start + row->gap_len + grow],
+      &row->chars[row->gap_start + row->gap_len], tail + 1);
+    row->gap_len += grow;
+}
+
+/**
+ * Drops every character from chars index at to the end of the row
+ */
+void editor_row_truncate(erow * row, int at) {
+    editor_row_move_gap(row, at);
+    row->gap_len += row->size - at;
+    row->size     = at;
+    editor_free_chunks(row);
+    row_tree_resize(row);
+}
+
+/**
+ * Uses the chars string of an erow to fill in the contents of the render string,
+ * replaces any tabs with spaces and records where each tab landed for the
+ * cx/rx conversions, and where each byte goes on screen unless the row is
+ * plain ASCII. Long rows only get the window around their anchor rendered,
+ * see "Long Rows". Leaves hl stale, see editor_prepare_row()
+ */
+void editor_update_row(erow * row) {
+    if (row->size >= ROW_LONG_SIZE && row->chunks == NULL) {
+        editor_chunks_build(row);
+    }
+    else if (row->chunks && row->size < ROW_LONG_SIZE / 2) {
+        editor_free_chunks(row);
+    }
+    if (row->chunks) {
+        editor_row_window(row);
+    }
+    else {
+        row->win_start = 0;
+        row->win_end   = row->size;
+        row->win_col   = 0;
+    }
+    int from  = row->win_start;
+    int to    = row->win_end;
+    int split = (to < row->gap_start) ? to : (from > row->gap_start) ? from : row->gap_start;
+    int ascii = utf8_is_ascii(&row->chars[from], split - from) &&
+      utf8_is_ascii(&row->chars[split + row->gap_len], to - split);
+    int rsize = 0;
+    int col   = row->win_col;
+    int ntabs = 0;
+
+    for (int i = from; i < to; ) {
+        unsigned int cp = (unsigned char)ROW_CHAR(row, i);
+        int len = (ascii || cp < 0x80) ? 1 : editor_row_decode(row, i, &cp);
+        if (cp == '\t') {
+            rsize += E.tab_stop - (col % E.tab_stop);
+            col   += E.tab_stop - (col % E.tab_stop);
+            ntabs++;
+        }
+        else {
+            rsize += len;
+            col   += (cp < 0x80) ? 1 : utf8_width(cp);
+        }
+        i += len;
+    }
+    if (row->render == NULL || rsize != row->rsize || ascii != (row->colmap == NULL)) {
+        pool_free(row->render, row->rsize + 1);
+        pool_free(row->hl, row->rsize);
+        pool_free(row->colmap, sizeof(int) * (row->rsize + 1));
+        row->render = pool_alloc(rsize + 1);
+        row->hl     = pool_alloc(rsize);
+        row->colmap = ascii ? NULL : pool_alloc(sizeof(int) * (rsize + 1));
+    }
+    if (ntabs != row->ntabs) {
+        pool_free(row->tabs, sizeof(int) * 2 * row->ntabs);
+        row->tabs  = ntabs ? pool_alloc(sizeof(int) * 2 * ntabs) : NULL;
+        row->ntabs = ntabs;
+    }
+    int idx = 0;
+    int tab = 0;
+    col = row->win_col;
+    for (int i = from; i < to; ) {
+        char c = ROW_CHAR(row, i);
+        if (c == '\t') {
+            do {
+                if (row->colmap) {
+                    row->colmap[idx] = col;
+                }
+                row->render[idx++] = ' ';
+                col++;
+            } while (col % E.tab_stop != 0);
+            row->tabs[tab++] = i++ - from;
+            row->tabs[tab++] = idx;
+        }
+        else if (row->colmap == NULL || (unsigned char)c < 0x80) {
+            if (row->colmap) {
+                row->colmap[idx] = col;
+            }
+            row->render[idx++] = c;
+            col++;
+            i++;
+        }
+        else {
+            unsigned int cp;
+            int len = editor_row_decode(row, i, &cp);
+            for (int k = 0; k < len; k++) {
+                row->colmap[idx]   = col;
+                row->render[idx++] = ROW_CHAR(row, i + k);
+            }
+            col += utf8_width(cp);
+            i   += len;
+        }
+    }
+    if (row->colmap) {
+        row->colmap[idx] = col;
+    }
+    row->render[idx] = '\0';
+    row->rsize       = idx;
+    row->wrap_cols   = 0;
+    row->tab_stop    = E.tab_stop;
+    if (row->flags & ROW_HL_VALID) { // Only the tab stop changed, the row still ends the same
+        row->flags |= ROW_HL_ENDS;
+    }
+    row->flags = (row->flags | ROW_RENDER_VALID) & ~ROW_HL_VALID;
+}
+
+/**
+ * Decodes the character starting at chars index at, returns its length
+ */
+int editor_row_decode(erow * row, int at, unsigned int * cp) {
+    char s[4];
+    int n = 0;
+
+    while (n < 4 && at + n < row->size) {
+        s[n] = ROW_CHAR(row, at + n);
+        n++;
+    }
+    return utf8_decode(s, n, cp);
+}
+
+/**
+ * Returns the chars index of the character after the one at cx
+ */
+int editor_row_next_char(erow * row, int cx) {
+    if (cx < row->size) {
+        cx++;
+    }
+    while (cx < row->size && UTF8_CONT(ROW_CHAR(row, cx))) {
+        cx++;
+    }
+    return cx;
+}
+
+/**
+ * Returns the chars index of the character before cx, or of the start of
+ * the character holding cx if cx falls inside one
+ */
+int editor_row_prev_char(erow * row, int cx) {
+    if (cx > 0) {
+        cx--;
+    }
+    while (cx > 0 && UTF8_CONT(ROW_CHAR(row, cx))) {
+        cx--;
+    }
+    return cx;
+}
+
+/**
+ * Frees the render, hl, tab and column strings of a row
+ */
+void editor_free_render(erow * row) {
+    pool_free(row->render, row->rsize + 1);
+    pool_free(row->hl, row->rsize);
+    pool_free(row->tabs, sizeof(int) * 2 * row->ntabs);
+    pool_free(row->colmap, sizeof(int) * (row->rsize + 1));
+    pool_free(row->wraps, sizeof(int) * row->nwraps);
+    editor_free_chunks(row);
+    row->render = NULL;
+    row->hl     = NULL;
+    row->tabs   = NULL;
+    row->colmap = NULL;
+    row->wraps  = NULL;
+    row->wrap_cols = 0;
+    row->rsize  = 0;
+    row->ntabs  = 0;
+}
+
+/*
+ * render and hl are only built when something looks at them: new and edited
+ * rows are merely flagged stale, and editor_draw_rows() and the search
+ * prepare the rows they touch. Opening a file thus costs little more than
+ * reading it, and rows the user never scrolls to are never rendered.
+ */
+
+/**
+ * Marks the render and hl strings of a row as out of date
+ */
+void editor_invalidate_row(erow * row) {
+    row->flags &= ~(ROW_RENDER_VALID | ROW_HL_VALID | ROW_HL_ENDS);
+}
+
+/**
+ * Returns whether render is up to date, which it is not after the tab stop
+ * changed since it was built, see editor_set_tab_stop()
+ */
+int editor_row_rendered(erow * row) {
+    return (row->flags & ROW_RENDER_VALID) && row->tab_stop == E.tab_stop;
+}
+
+/**
+ * Makes sure the render and hl strings of a row are up to date. Highlighting
+ * depends on whether the previous row ends inside a multiline comment, so
+ * the state is carried forward through any stale rows right above, from the
+ * closest row that is still valid or whose state the worker found, and
+ * through the rows from E.hl_stale on, see editor_syntax_stale(). Only the
+ * state those rows end in is found, they are not rendered, so a far jump
+ * renders the rows on screen and no others. Past HL_GUESS_ROWS rows the
+ * state is guessed if the worker is still to find it, see "Background
+ * Highlighting". The pager skips this and takes whatever state the previous
+ * row last had
+ */
+void editor_prepare_row(erow * row) {
+    int stale = E.hl_stale && editor_row_index(E.hl_stale) <= editor_row_index(row);
+    if (editor_hl_worker_guessed(row)) {
+        row->flags &= ~(ROW_HL_VALID | ROW_HL_ENDS);
+    }
+    if ((row->flags & ROW_HL_VALID) && editor_row_rendered(row) && !stale) {
+        return;
+    }
+    erow * first = stale ? E.hl_stale : row;
+    if (E.syntax && E.syntax->lexer->multiline && !E.pager) {
+        erow * prev;
+        int walked = 0;
+        while ((prev = editor_row_prev(first))) {
+            if (editor_hl_worker_guessed(prev)) {
+                prev->flags &= ~(ROW_HL_VALID | ROW_HL_ENDS);
+            }
+            if ((prev->flags & (ROW_HL_VALID | ROW_HL_ENDS)) || editor_hl_worker_state(first) >= 0) {
+                break;
+            }
+            if (walked++ == HL_GUESS_ROWS && E.hl_worker.running && editor_row_index(first) <= E.hl_worker.limit) {
+                break; // Guess for now, the worker will tell
+            }
+            first = prev;
+        }
+    }
+    for (erow * r = first; r != row; r = editor_row_next(r)) {
+        if (!(r->flags & (ROW_HL_VALID | ROW_HL_ENDS))) {
+            editor_syntax_row_end(r);
+        }
+    }
+    if (!editor_row_rendered(row)) {
+        editor_update_row(row);
+    }
+    if (!(row->flags & ROW_HL_VALID)) {
+        editor_update_syntax(row);
+    }
+    if (stale) { // Every row flagged stale is now further down
+        E.hl_stale = E.hl_stale_rows ? editor_row_next(row) : NULL;
+    }
+}
+
+/*
+ * cx indexes chars, rx is a display column, and in between render bytes are
+ * reached through the tab table, a binary search away, and turned into
+ * columns through the colmap, a lookup away, so none of these walk the row.
+ */
+
+/**
+ * Calculates the value of rx in editor_scroll
+ */
+int editor_row_cx_to_rx(erow * row, int cx) {
+    return editor_row_rbyte_to_rx(row, editor_row_cx_to_rbyte(row, cx));
+}
+
+/**
+ * Converts the render index into a chars index
+ */
+int editor_row_rx_to_cx(erow * row, int rx) {
+    return editor_row_rbyte_to_cx(row, editor_row_rx_to_rbyte(row, rx));
+}
+
+/**
+ * Converts a chars index into the index of its first byte in render
+ */
+int editor_row_cx_to_rbyte(erow * row, int cx) {
+    if (row->chunks && (cx < row->win_start || cx > row->win_end)) {
+        row->chunks->anchor = cx;
+        editor_invalidate_row(row);
+    }
+    if (!editor_row_rendered(row)) {
+        editor_update_row(row);
+    }
+    cx -= row->win_start;
+    int lo = 0; // Number of tabs before cx
+    int hi = row->ntabs;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (row->tabs[2 * mid] < cx) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return cx;
+    }
+    return row->tabs[2 * lo - 1] + (cx - row->tabs[2 * lo - 2] - 1);
+}
+
+/**
+ * Converts an index into render into the chars index it came from
+ */
+int editor_row_rbyte_to_cx(erow * row, int rbyte) {
+    if (!editor_row_rendered(row)) {
+        editor_update_row(row);
+    }
+    int lo = 0; // Number of tabs ending at or before rbyte
+    int hi = row->ntabs;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (row->tabs[2 * mid + 1] <= rbyte) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    int cx = lo ? row->tabs[2 * lo - 2] + 1 + (rbyte - row->tabs[2 * lo - 1]) : rbyte;
+    if (lo < row->ntabs && cx > row->tabs[2 * lo]) { // rbyte falls inside the next tab
+        cx = row->tabs[2 * lo];
+    }
+    cx += row->win_start;
+    return cx < row->win_end ? cx : row->win_end;
+}
+
+/**
+ * Returns the display column of a render index
+ */
+int editor_row_rbyte_to_rx(erow * row, int rbyte) {
+    if (!editor_row_rendered(row)) {
+        editor_update_row(row);
+    }
+    if (row->colmap == NULL) {
+        return row->win_col + rbyte;
+    }
+    return row->colmap[rbyte < row->rsize ? rbyte : row->rsize];
+}
+
+/**
+ * Returns the render index of the first byte of the character shown at
+ * display column rx, or rsize past the end of the row. The window of a long
+ * row is moved to cover the screen width from rx on if it does not already
+ */
+int editor_row_rx_to_rbyte(erow * row, int rx) {
+    if (!editor_row_rendered(row)) {
+        editor_update_row(row);
+    }
+    if (row->chunks && (rx < row->win_col ||
+      (rx + E.col > editor_row_rbyte_to_rx(row, row->rsize) && row->win_end < row->size)))
+    {
+        row->chunks->anchor = row->chunks->c[editor_chunk_find_col(row, rx)].start;
+        editor_invalidate_row(row);
+        editor_update_row(row);
+    }
+    if (row->colmap == NULL) {
+        rx -= row->win_col;
+        return rx < 0 ? 0 : rx < row->rsize ? rx : row->rsize;
+    }
+    int lo = 0; // First byte shown past rx
+    int hi = row->rsize + 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (row->colmap[mid] <= rx) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    if (lo > row->rsize) {
+        return row->rsize;
+    }
+    int rbyte = lo - 1;
+    while (rbyte > 0 && row->colmap[rbyte - 1] == row->colmap[rbyte]) {
+        rbyte--;
+    }
+    return rbyte < 0 ? 0 : rbyte;
+}
+
+/**
+ * Inserts a single character into an erow at a given position
+ */
+void editor_row_insert_char(erow * row, int at, int c) {
+    if (at < 0 || at > row->size) {
+        at = row->size;
+    }
+    editor_row_move_gap(row, at);
+    editor_row_reserve(row, 1);
+    row->chars[row->gap_start++] = c;
+    row->gap_len--;
+    row->size++;
+    editor_row_chunk_edit(row, at, 1);
+    row_tree_resize(row);
+    editor_invalidate_row(row);
+    E.dirty++;
+}
+
+/**
+ * Allows the deletion of characters from erow
+ */
+void editor_row_del_char(erow * row, int at) {
+    if (at < 0 || at >= row->size) {
+        return;
+    }
+    editor_row_move_gap(row, at + 1);
+    row->gap_start--;
+    row->gap_len++;
+    row->size--;
+    editor_row_chunk_edit(row, at, -1);
+    row_tree_resize(row);
+    editor_invalidate_row(row);
+    E.dirty++;
+}
+
+/**
+ * Frees an erow and the strings it owns
+ */
+void editor_free_row(erow * row) {
+    if (row->flags & ROW_HL_STALE) {
+        E.hl_stale_rows--;
+    }
+    editor_free_render(row);
+    if (editor_row_shared(row)) {
+        editor_save_defer(row->chars, row->size + row->gap_len + 1);
+    }
+    else if (!(row->flags & ROW_MAPPED)) {
+        pool_free(row->chars, row->size + row->gap_len + 1);
+    }
+    else {
+        E.mapped_rows--;
+    }
+    pool_free(row, sizeof(erow));
+}
+
+/**
+ * Deletes a row
+ */
+void editor_del_row(int at) {
+    if (at < 0 || at >= E.numrows) {
+        return;
+    }
+    erow * row  = row_tree_remove(at);
+    erow * next = editor_row_at(at);
+    editor_hl_worker_edited(at);
+    if (row == E.hl_stale) {
+        E.hl_stale = next;
+    }
+    editor_free_row(row);
+    if (next) { // The next row now follows a different row
+        editor_invalidate_row(next);
+    }
+    E.dirty++;
+}
+
+/**
+ * Drops every row of the current buffer, only blocks too big for the pool
+ * are freed one by one, the rest goes back with the slabs
+ */
+void editor_close_buffer() {
+    editor_save_wait(); // The save may still be reading rows and the mapping
+    editor_hl_worker_stop(); // And so may the worker
+    E.hl_worker.limit = 0;
+    for (erow * row = row_tree_first(); row; row = row_tree_next(row)) {
+        if (row->flags & ROW_SPAN) {
+            continue;
+        }
+        if (pool_class(row->rsize + 1) == -1) {
+            free(row->render);
+            free(row->hl);
+        }
+        if (pool_class(sizeof(int) * 2 * row->ntabs) == -1) {
+            free(row->tabs);
+        }
+        if (pool_class(sizeof(int) * (row->rsize + 1)) == -1) {
+            free(row->colmap);
+        }
+        if (pool_class(sizeof(int) * row->nwraps) == -1) {
+            free(row->wraps);
+        }
+        editor_free_chunks(row);
+        if (!(row->flags & ROW_MAPPED) && pool_class(row->size + row->gap_len + 1) == -1) {
+            free(row->chars);
+        }
+    }
+    pool_release();
+    if (E.file.map) {
+        munmap(E.file.map, E.file.size);
+    }
+    free(E.file.index);
+    memset(&E.file, 0, sizeof(E.file));
+    E.mapped_rows = 0;
+    E.hl_stale    = NULL;
+    E.hl_stale_rows = 0;
+    E.editor_row = NULL;
+    E.numrows    = 0;
+    E.cx         = 0;
+    E.cy         = 0;
+    E.rowoff     = 0;
+    E.coloff     = 0;
+    E.dirty      = 0;
+}
+
+/**
+ * Appends a string to the end of a row
+ */
+void editor_row_append_string(erow * row, char * s, size_t len) {
+    editor_row_move_gap(row, row->size);
+    editor_row_reserve(row, len);
+    memcpy(&row->chars[row->size], s, len);
+    row->size      += len;
+    row->gap_start += len;
+    row->gap_len   -= len;
+    editor_free_chunks(row);
+    row_tree_resize(row);
+    editor_invalidate_row(row);
+    E.dirty++;
+}
+
+/**
+ * Returns the chars index of the first match of query in row, or -1. Rows
+ * are searched in chars, on either side of the gap and across it, like the
+ * spans editor_find_raw() scans in the mapped file, so a match never depends
+ * on tabs being expanded; callers map it to render with the tab stops
+ */
+int editor_row_find(erow * row, const char * query) {
+    size_t qlen = strlen(query);
+    char * tail = &row->chars[row->gap_start + row->gap_len];
+    char * m    = memmem(row->chars, row->gap_start, query, qlen);
+
+    if (m) {
+        return m - row->chars;
+    }
+    if (qlen > 1 && row->gap_start > 0 && row->gap_start < row->size) { // A match may straddle the gap
+        char buf[2 * FIND_STRADDLE_MAX];
+        int before = (row->gap_start < (int)qlen - 1) ? row->gap_start : (int)qlen - 1;
+        int after  = (row->size - row->gap_start < (int)qlen - 1) ? row->size - row->gap_start : (int)qlen - 1;
+        if (before + after <= (int)sizeof(buf)) {
+            memcpy(buf, &row->chars[row->gap_start - before], before);
+            memcpy(&buf[before], tail, after);
+            m = memmem(buf, before + after, query, qlen);
+            if (m) {
+                return row->gap_start - before + (int)(m - buf);
+            }
+        }
+        else { // Too long a query to copy, compared in place
+            for (int at = row->gap_start - before; at < row->gap_start && at + (int)qlen <= row->size; at++) {
+                size_t i = 0;
+                while (i < qlen && ROW_CHAR(row, at + (int)i) == query[i]) {
+                    i++;
+                }
+                if (i == qlen) {
+                    return at;
+                }
+            }
+        }
+    }
+    m = memmem(tail, row->size - row->gap_start, query, qlen);
+    return m ? row->gap_start + (m - tail) : -1;
+}
+
+/********************************
+* Long Rows
+********************************/
+
+/*
+ * A row of ROW_LONG_SIZE bytes or more, a minified file on one line say, is
+ * too long to render and highlight whole after every keystroke. Its chars
+ * stay one gap buffer, edits there are already local, but the row is also
+ * cut into chunks of about ROW_CHUNK_SIZE bytes that each know their length,
+ * their width on screen and the highlighter state they start in. An edit
+ * only measures its own chunk again, and only rescans the states from that
+ * chunk on until the window. The states past it are found when a row below
+ * asks how this one ends, or, when a row below is already highlighted, while
+ * no key is pending, see editor_syntax_finish(). Render, hl and the other
+ * per-row tables then only cover a window of a few chunks around an anchor,
+ * the cursor or the first column on screen, and the cx/rx conversions move
+ * the window whenever they are asked about a spot outside of it.
+ */
+
+/**
+ * Cuts row into chunks, on character boundaries, and measures them
+ */
+void editor_chunks_build(erow * row) {
+    struct row_chunks * ch = malloc(sizeof(struct row_chunks));
+
+    ch->cap = row->size / ROW_CHUNK_SIZE + 1;
+    ch->c   = malloc(sizeof(struct row_chunk) * ch->cap);
+    ch->n   = 0;
+    for (int start = 0; start < row->size || ch->n == 0; ) {
+        int end = start + ROW_CHUNK_SIZE < row->size ? start + ROW_CHUNK_SIZE : row->size;
+        while (end < row->size && UTF8_CONT(ROW_CHAR(row, end))) {
+            end++;
+        }
+        if (ch->n == ch->cap) {
+            ch->cap *= 2;
+            ch->c    = realloc(ch->c, sizeof(struct row_chunk) * ch->cap);
+        }
+        struct row_chunk * k = &ch->c[ch->n++];
+        k->len   = end - start;
+        k->state = -1;
+        editor_chunk_measure(row, k, start);
+        start = end;
+    }
+    ch->c[0].start = 0;
+    ch->c[0].col   = 0;
+    ch->known      = 1;
+    ch->tab_stop   = E.tab_stop;
+    ch->syntax     = E.syntax;
+    ch->hl_first   = 0;
+    ch->hl_last    = ch->n - 1;
+    ch->anchor     = 0;
+    row->chunks    = ch;
+}
+
+/**
+ * Drops the chunks of a row, it is rendered whole again
+ */
+void editor_free_chunks(erow * row) {
+    if (row == E.hl_long) { // No states are left to find
+        E.hl_long = NULL;
+    }
+    if (row->chunks) {
+        free(row->chunks->c);
+        free(row->chunks);
+        row->chunks = NULL;
+    }
+}
+
+/**
+ * Finds how many columns chunk c starting at chars index start takes, see
+ * editor_chunk_advance()
+ */
+void editor_chunk_measure(erow * row, struct row_chunk * c, int start) {
+    int col = 0;
+    int tab = 0;
+
+    for (int i = start; i < start + c->len; ) {
+        unsigned int cp = (unsigned char)ROW_CHAR(row, i);
+        int len = (cp < 0x80) ? 1 : editor_row_decode(row, i, &cp);
+        if (cp == '\t' && !tab) { // Where it lands depends on what comes before the chunk
+            tab    = 1;
+            c->pre = col;
+            col    = 0;
+        }
+        else if (cp == '\t') {
+            col += E.tab_stop - (col % E.tab_stop);
+        }
+        else {
+            col += (cp < 0x80) ? 1 : utf8_width(cp);
+        }
+        i += len;
+    }
+    if (tab) {
+        c->rest = col;
+    }
+    else {
+        c->pre  = col;
+        c->rest = -1;
+    }
+}
+
+/**
+ * Returns the column a chunk starting at column col ends at
+ */
+int editor_chunk_advance(struct row_chunk * c, int col) {
+    if (c->rest < 0) {
+        return col + c->pre;
+    }
+    return ((col + c->pre) / E.tab_stop + 1) * E.tab_stop + c->rest;
+}
+
+/**
+ * Brings the start and col of chunk k up to date, along with every chunk
+ * before it. Edits only invalidate the chunks after theirs, so while the
+ * cursor stays in one place this only ever walks a chunk or two
+ */
+void editor_chunk_locate(erow * row, int k) {
+    struct row_chunks * ch = row->chunks;
+
+    for ( ; ch->known <= k; ch->known++) {
+        struct row_chunk * prev = &ch->c[ch->known - 1];
+        ch->c[ch->known].start = prev->start + prev->len;
+        ch->c[ch->known].col   = editor_chunk_advance(prev, prev->col);
+    }
+}
+
+/**
+ * Returns the chunk holding chars index at, or the last one if at is past
+ * the end
+ */
+int editor_chunk_find(erow * row, int at) {
+    struct row_chunks * ch = row->chunks;
+
+    while (ch->known < ch->n && ch->c[ch->known - 1].start + ch->c[ch->known - 1].len <= at) {
+        editor_chunk_locate(row, ch->known);
+    }
+    int lo = 0; // Last chunk starting at or before at
+    int hi = ch->known - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (ch->c[mid].start <= at) {
+            lo = mid;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Returns the chunk shown at display column rx, or the last one if rx is
+ * past the end
+ */
+int editor_chunk_find_col(erow * row, int rx) {
+    struct row_chunks * ch = row->chunks;
+
+    while (ch->known < ch->n && editor_chunk_advance(&ch->c[ch->known - 1], ch->c[ch->known - 1].col) <= rx) {
+        editor_chunk_locate(row, ch->known);
+    }
+    int lo = 0; // Last chunk starting at or before rx
+    int hi = ch->known - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (ch->c[mid].col <= rx) {
+            lo = mid;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Splits chunk k, whose start is known, in two
+ */
+void editor_chunk_split(erow * row, int k) {
+    struct row_chunks * ch = row->chunks;
+    int start = ch->c[k].start;
+    int mid   = start + ch->c[k].len / 2;
+
+    while (mid < start + ch->c[k].len && UTF8_CONT(ROW_CHAR(row, mid))) {
+        mid++;
+    }
+    if (mid == start + ch->c[k].len) {
+        return;
+    }
+    if (ch->n == ch->cap) {
+        ch->cap *= 2;
+        ch->c    = realloc(ch->c, sizeof(struct row_chunk) * ch->cap);
+    }
+    memmove(&ch->c[k + 2], &ch->c[k + 1], sizeof(struct row_chunk) * (ch->n - k - 1));
+    ch->n++;
+    ch->c[k + 1].len   = start + ch->c[k].len - mid;
+    ch->c[k + 1].state = -1; // Found again from chunk k on
+    ch->c[k].len       = mid - start;
+    editor_chunk_measure(row, &ch->c[k], start);
+    editor_chunk_measure(row, &ch->c[k + 1], mid);
+    if (ch->hl_last > k) {
+        ch->hl_last++;
+    }
+}
+
+/**
+ * Tells the chunks of row that delta bytes were inserted at, or removed
+ * from, chars index at
+ */
+void editor_row_chunk_edit(erow * row, int at, int delta) {
+    struct row_chunks * ch = row->chunks;
+
+    if (ch == NULL) {
+        return;
+    }
+    if (ch->anchor > at) {
+        ch->anchor += delta;
+    }
+    // An insert right at the end of a chunk goes to that chunk, so the bytes
+    // of a character typed there stay together
+    int k = editor_chunk_find(row, (delta > 0 && at > 0) ? at - 1 : at);
+    ch->c[k].len += delta;
+    ch->known     = k + 1; // Later chunks moved, and may have moved across a tab stop
+    if (ch->hl_last < 0) {
+        ch->hl_first = k;
+        ch->hl_last  = k;
+    }
+    else {
+        ch->hl_first = k < ch->hl_first ? k : ch->hl_first;
+        ch->hl_last  = k > ch->hl_last ? k : ch->hl_last;
+    }
+    if (ch->c[k].len == 0 && ch->n > 1) { // The next chunk takes over its place and state
+        int start = ch->c[k].start;
+        int col   = ch->c[k].col;
+        int state = ch->c[k].state;
+        memmove(&ch->c[k], &ch->c[k + 1], sizeof(struct row_chunk) * (ch->n - k - 1));
+        ch->n--;
+        if (k == ch->n) {
+            k--;
+        }
+        else {
+            ch->c[k].start = start;
+            ch->c[k].col   = col;
+            ch->c[k].state = state;
+        }
+        ch->known    = k + 1;
+        ch->hl_first = (k < ch->hl_first) ? k : ch->hl_first;
+        ch->hl_last  = (ch->hl_last >= ch->n) ? ch->n - 1 : ch->hl_last;
+        return;
+    }
+    editor_chunk_measure(row, &ch->c[k], ch->c[k].start);
+    if (ch->c[k].len > ROW_CHUNK_MAX) {
+        editor_chunk_split(row, k);
+    }
+}
+
+/**
+ * Picks the chunks render covers: the one holding the anchor, one on either
+ * side, and more until there is a screen width on either side, or a whole
+ * screen after it with soft wrap on
+ */
+void editor_row_window(erow * row) {
+    struct row_chunks * ch = row->chunks;
+
+    if (ch->tab_stop != E.tab_stop) {
+        ch->tab_stop = E.tab_stop;
+        ch->known    = 1;
+        for (int k = 0, start = 0; k < ch->n; k++) {
+            editor_chunk_measure(row, &ch->c[k], start);
+            start += ch->c[k].len;
+        }
+    }
+    if (ch->anchor > row->size) {
+        ch->anchor = row->size;
+    }
+    int k     = editor_chunk_find(row, ch->anchor);
+    int first = k > 0 ? k - 1 : 0;
+    while (first > 0 && ch->c[k].col - ch->c[first].col < E.col) {
+        first--;
+    }
+    int last   = k;
+    int margin = E.wrap ? E.col * E.row : E.col;
+    int k_end  = editor_chunk_advance(&ch->c[k], ch->c[k].col);
+    while (last < ch->n - 1) {
+        editor_chunk_locate(row, last + 1);
+        if (last > k && ch->c[last + 1].col - k_end >= margin) {
+            break;
+        }
+        last++;
+    }
+    row->win_start = ch->c[first].start;
+    row->win_end   = ch->c[last].start + ch->c[last].len;
+    row->win_col   = ch->c[first].col;
+}
+
+/**
+ * Returns how many columns row takes on screen
+ */
+int editor_row_width(erow * row) {
+    if (!editor_row_rendered(row)) {
+        editor_update_row(row);
+    }
+    if (row->chunks == NULL) {
+        return editor_row_rbyte_to_rx(row, row->rsize);
+    }
+    struct row_chunk * last = &row->chunks->c[row->chunks->n - 1];
+    editor_chunk_locate(row, row->chunks->n - 1);
+    return editor_chunk_advance(last, last->col);
+}
+
+/**
+ * Brings the highlighter states of the chunks of row up to date when the row
+ * starts in state: from the first chunk edited on, until past the last one
+ * edited a chunk starts in the same state as before, but no further than
+ * chunk stop, the rest is left for later. Returns the state the row ends
+ * in, -1 if that did not change, or -2 if it is not known yet
+ */
+int editor_chunks_highlight(erow * row, int state, int stop) {
+    struct row_chunks * ch = row->chunks;
+    char buf[ROW_CHUNK_MAX + HL_LOOKAHEAD + 1];
+
+    if (ch->syntax != E.syntax) {
+        for (int k = 0; k < ch->n; k++) {
+            ch->c[k].state = -1;
+        }
+        ch->syntax   = E.syntax;
+        ch->hl_first = 0;
+        ch->hl_last  = ch->n - 1;
+    }
+    if (ch->c[0].state != state) {
+        ch->c[0].state = state;
+        ch->hl_first   = 0;
+        ch->hl_last    = ch->hl_last < 0 ? 0 : ch->hl_last;
+    }
+    if (ch->hl_last < 0) {
+        return -1;
+    }
+    editor_chunk_locate(row, ch->hl_first);
+    int start = ch->c[ch->hl_first].start;
+    for (int k = ch->hl_first; k < ch->n; k++) {
+        if (k >= stop) { // The state chunk k starts in is right, the ones after may not be
+            ch->hl_first = k;
+            ch->hl_last  = (k > ch->hl_last) ? k : ch->hl_last;
+            return -2;
+        }
+        int len   = ch->c[k].len;
+        int avail = (row->size - start < len + HL_LOOKAHEAD) ? row->size - start : len + HL_LOOKAHEAD;
+        for (int i = 0; i < avail; i++) {
+            buf[i] = ROW_CHAR(row, start + i);
+        }
+        buf[avail] = '\0';
+        state  = editor_syntax_scan(buf, len, avail, NULL, ch->c[k].state);
+        start += len;
+        if (k == ch->n - 1) {
+            break;
+        }
+        if (k >= ch->hl_last && ch->c[k + 1].state == state) {
+            ch->hl_last = -1;
+            return -1;
+        }
+        ch->c[k + 1].state = state;
+    }
+    ch->hl_last = -1;
+    return state;
+}
+
+/********************************
+* Pager
+********************************/
+
+/*
+ * Files bigger than TEDITOR_PAGER_THRESHOLD, or any file when started with
+ * -p, are paged: only the rows within TEDITOR_PAGER_MARGIN of the screen
+ * stay materialized. Once more than TEDITOR_PAGER_ROWS mapped rows exist,
+ * the ones far from the screen are turned back into spans, and runs of
+ * adjacent spans are merged, so memory stays bounded however far the user
+ * scrolls; evicted lines are simply located again in the mapped file when
+ * they come back into view. Edited rows are never evicted. Search scans the
+ * mapped text directly, see editor_find_raw().
+ */
+
+/**
+ * Evicts the mapped rows that are far from the screen
+ */
+void editor_pager_evict() {
+    if (!E.pager || E.mapped_rows <= TEDITOR_PAGER_ROWS) {
+        return;
+    }
+    int lo   = E.rowoff - TEDITOR_PAGER_MARGIN;
+    int hi   = E.rowoff + E.row + TEDITOR_PAGER_MARGIN;
+    int line = 0;
+    for (erow * t = row_tree_first(); t; t = row_tree_next(t)) {
+        if ((t->flags & ROW_MAPPED) && (line < lo || line >= hi) && line != E.cy) {
+            editor_free_render(t);
+            t->flags  = ROW_SPAN; // span_first still holds the line it came from
+            E.mapped_rows--;
+        }
+        line += t->lines;
+    }
+    editor_pager_merge();
+}
+
+/**
+ * Merges every run of spans that cover consecutive lines of the file
+ */
+void editor_pager_merge() {
+    int line = 0;
+
+    for (erow * t = row_tree_first(); t; t = row_tree_next(t)) {
+        erow * next;
+        while ((t->flags & ROW_SPAN) && (next = row_tree_next(t)) && (next->flags & ROW_SPAN) &&
+          next->span_first == t->span_first + t->lines)
+        {
+            row_tree_unlink(line + t->lines, next->lines);
+            t->lines += next->lines;
+            t->bytes += next->bytes;
+            for (erow * p = t; p; p = p->parent) {
+                row_tree_update(p);
+            }
+            E.numrows = row_tree_count(E.editor_row);
+            pool_free(next, sizeof(erow));
+        }
+        line += t->lines;
+    }
+}
+
+/********************************
+* Editor Operations
+********************************/
+
+/**
+ * Insert character into the position the cursor is at
+ */
+void editor_insert_char(int c) {
+    if (E.cy == E.numrows) {
+        editor_insert_row(E.numrows, "", 0);
+    }
+    editor_row_insert_char(editor_row_at(E.cy), E.cx, c);
+    E.cx++;
+}
+
+/**
+ * Deletes the character that is to the left of the cursor, all of its bytes
+ */
+void editor_del_char() {
+    if (E.cy == E.numrows) {
+        return;
+    }
+    if (E.cx == 0 && E.cy == 0) {
+        return;
+    }
+    erow * row = editor_row_at(E.cy);
+    if (E.cx > 0) {
+        int start = editor_row_prev_char(row, E.cx);
+        while (E.cx > start) {
+            editor_row_del_char(row, --E.cx);
+        }
+    }
+    else {
+        erow * prev = editor_row_prev(row);
+        E.cx = prev->size;
+        editor_row_append_string(prev, editor_row_chars(row), row->size);
+        editor_del_row(E.cy);
+        E.cy--;
+    }
+}
+
+/**
+ * Inserts a new line into the position the cursor is at,
+ * if there is text to the right of the cursor, move it to the next row
+ */
+void editor_insert_newline() {
+    if (E.cx == 0) {
+        editor_insert_row(E.cy, "", 0);
+    }
+    else {
+        erow * row = editor_row_at(E.cy);
+        editor_insert_row(E.cy + 1, &editor_row_chars(row)[E.cx], row->size - E.cx);
+        editor_row_truncate(row, E.cx);
+        editor_invalidate_row(row);
+    }
+    E.cy++;
+    E.cx = 0;
+}
+
+/********************************
+* Find
+********************************/
+
+/**
+ * Method for a basic search feature
+ */
+void editor_find() {
+    int saved_cx      = E.cx;
+    int saved_cy      = E.cy;
+    int saved_coloff  = E.coloff;
+    int saved_rowoff  = E.rowoff;
+    int saved_wrapoff = E.wrapoff;
+    char * query      = editor_prompt("Search: %s (ESC/Enter to cancel)", editor_find_callback);
+
+    if (query) {
+        free(query);
+    }
+    else {
+        E.cx      = saved_cx;
+        E.cy      = saved_cy;
+        E.coloff  = saved_coloff;
+        E.rowoff  = saved_rowoff;
+        E.wrapoff = saved_wrapoff;
+    }
+}
+
+/**
+ * Loops through rows of a file and if a row contains the query string,
+ * move the cursor to the match, allows for iterative search
+ */
+void editor_find_callback(char * query, int key) {
+    static int last_match = -1;
+    static int direction  = 1;
+    static erow * saved_hl_row;
+    static char * saved_hl = NULL;
+    static int saved_hl_len;
+
+    if (saved_hl) {
+        if (saved_hl_row->rsize == saved_hl_len) {
+            memcpy(saved_hl_row->hl, saved_hl, saved_hl_len);
+        }
+        else { // A long row whose window moved
+            saved_hl_row->flags &= ~ROW_HL_VALID;
+        }
+        free(saved_hl);
+        saved_hl = NULL;
+    }
+    if (key == '\r' || key == '\x1b') {
+        last_match = -1;
+        direction  = 1;
+        return;
+    }
+    else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+        direction = 1;
+    }
+    else if (key == ARROW_LEFT || key == ARROW_UP) {
+        direction = -1;
+    }
+    else {
+        last_match = -1;
+        direction  = 1;
+    }
+
+    if (last_match == -1) {
+        direction = 1;
+    }
+    int cx;
+    int current = editor_find_raw(query, last_match + direction, direction, &cx);
+    if (current != -1) { // Only the matching line is turned into a row
+        erow * row = editor_row_at(current);
+        editor_row_cx_to_rbyte(row, cx); // Moves the window of a long row to the match
+        editor_prepare_row(row);
+        last_match = current;
+        E.cy       = current;
+        E.cx       = cx;
+        E.rowoff   = E.numrows;
+        editor_find_mark(row, cx, strlen(query), &saved_hl_row, &saved_hl, &saved_hl_len);
+    }
+} /* editor_find_callback */
+
+/**
+ * Highlights the render bytes of a match of len chars at chars index cx of
+ * row, tabs in it included, after saving the hl they cover for the next
+ * call of editor_find_callback()
+ */
+void editor_find_mark(erow * row, int cx, int len, erow ** saved_row, char ** saved, int * saved_len) {
+    int rbyte = editor_row_cx_to_rbyte(row, cx);
+    int end   = editor_row_cx_to_rbyte(row, (cx + len < row->win_end) ? cx + len : row->win_end);
+
+    *saved_row = row;
+    *saved     = malloc(row->rsize);
+    *saved_len = row->rsize;
+    memcpy(*saved, row->hl, row->rsize);
+    memset(&row->hl[rbyte], HL_MATCH, end - rbyte);
+}
+
+/**
+ * Searches for query from line from on in direction, wrapping around, and
+ * without turning the spans it passes over into rows: their text is scanned
+ * right in the mapped file. Returns the matching line and sets cx to the
+ * chars index of the match, or returns -1
+ */
+int editor_find_raw(char * query, int from, int direction, int * cx) {
+    size_t qlen = strlen(query);
+    int line    = from;
+    int len;
+
+    for (int seen = 0; seen < E.numrows; ) {
+        if (line < 0) {
+            line = E.numrows - 1;
+        }
+        else if (line >= E.numrows) {
+            line = 0;
+        }
+        int offset;
+        erow * t = row_tree_find(line, &offset);
+        if (!(t->flags & ROW_SPAN)) {
+            *cx = editor_row_find(t, query);
+            if (*cx != -1) {
+                return line;
+            }
+            line += direction;
+            seen++;
+            continue;
+        }
+        // Scan from the current line to the end of the span, or from the
+        // start of the span up to the end of the current line
+        char * cur   = editor_file_line(t->span_first + offset, &len);
+        char * first = (direction == 1) ? cur : editor_file_line(t->span_first, &len);
+        char * last  = (direction == 1) ? editor_file_line(t->span_first + t->lines - 1, &len) : cur;
+        if (direction == -1) {
+            editor_file_line_len(cur, &len);
+        }
+        char * end   = &last[len];
+        char * match = NULL;
+        for (char * p = first; p < end; p = match + 1) {
+            char * m = memmem(p, end - p, query, qlen);
+            if (m == NULL) {
+                break;
+            }
+            match = m;
+            if (direction == 1) {
+                break;
+            }
+        }
+        if (match) {
+            int lines  = 0;
+            char * bol = first;
+            for (char * nl; (nl = memchr(bol, '\n', match - bol)); bol = nl + 1) {
+                lines++;
+            }
+            *cx = match - bol;
+            return line - (direction == 1 ? 0 : offset) + lines;
+        }
+        if (direction == 1) {
+            seen += t->lines - offset;
+            line += t->lines - offset;
+        }
+        else {
+            seen += offset + 1;
+            line -= offset + 1;
+        }
+    }
+    return -1;
+}
+
+/********************************
+* Goto
+********************************/
+
+/*
+ * Every node of the row tree also keeps the byte count of its subtree, so a
+ * byte offset is found with the same O(log n) descent as a line number.
+ * Inside a span the sparse line index of the mapped file narrows the search
+ * down to TEDITOR_INDEX_STRIDE lines, so neither jump ever walks the rows
+ * in between.
+ */
+
+/**
+ * Prompts for a line number and moves the cursor to the start of that line
+ */
+void editor_goto_line() {
+    char * input = editor_prompt("Go to line: %s (ESC to cancel)", NULL);
+
+    if (input == NULL) {
+        return;
+    }
+    char * end;
+    long line = strtol(input, &end, 10);
+    if (end == input || *end != '\0' || line < 1) {
+        editor_set_status_message("Invalid line number: %s", input);
+    }
+    else {
+        editor_jump(line < E.numrows ? line - 1 : E.numrows - 1, 0, 1);
+    }
+    free(input);
+}
+
+/**
+ * Prompts for a byte offset into the file and moves the cursor onto that byte
+ */
+void editor_goto_offset() {
+    char * input = editor_prompt("Go to byte: %s (ESC to cancel)", NULL);
+
+    if (input == NULL) {
+        return;
+    }
+    char * end;
+    long long off = strtoll(input, &end, 0);
+    if (end == input || *end != '\0' || off < 0) {
+        editor_set_status_message("Invalid byte offset: %s", input);
+    }
+    else {
+        int cx;
+        int at = editor_offset_to_line((size_t)off, &cx);
+        editor_jump(at, cx, 1);
+    }
+    free(input);
+}
+
+/**
+ * Returns the line holding byte off and sets cx to the chars index of the
+ * byte in it, offsets past the end of the buffer give the line after it
+ */
+int editor_offset_to_line(size_t off, int * cx) {
+    int at;
+    size_t offset;
+    erow * t = row_tree_find_offset(off, &at, &offset);
+
+    *cx = 0;
+    if (t == NULL) {
+        return E.numrows;
+    }
+    if (t->flags & ROW_SPAN) {
+        size_t start = editor_file_offset(t->span_first);
+        int line     = editor_file_line_of(start + offset);
+        at     += line - t->span_first;
+        offset -= editor_file_offset(line) - start;
+    }
+    t   = editor_row_at(at);
+    *cx = (int)offset < t->size ? (int)offset : t->size;
+    return at;
+}
+
+/**
+ * Moves the cursor to line at, keeping cx within the line, center scrolls
+ * the line to the middle of the screen if it is out of view
+ */
+void editor_jump(int at, int cx, int center) {
+    erow * row = editor_row_at(at);
+
+    E.cy = row ? at : E.numrows;
+    E.cx = row ? (cx < row->size ? cx : row->size) : 0;
+    if (row && E.cx < row->size && UTF8_CONT(ROW_CHAR(row, E.cx))) {
+        E.cx = editor_row_prev_char(row, E.cx);
+    }
+    if (center && (E.cy < E.rowoff || E.cy >= E.rowoff + E.row)) {
+        E.rowoff  = E.cy > E.row / 2 ? E.cy - E.row / 2 : 0;
+        E.wrapoff = 0;
+    }
+}
+
+/********************************
+* Soft Wrap
+********************************/
+
+/*
+ * With soft wrap on, a line takes as many screen lines, its visual rows, as
+ * it needs to fit the width of the screen. Each row keeps where its visual
+ * rows start, computed when the row is first laid out for the current width
+ * and again only once it is edited or the width changes, and ASCII rows do
+ * not even need that since theirs start every E.col bytes. The top of the
+ * screen is visual row E.wrapoff of line E.rowoff, and scrolling, paging and
+ * drawing all count visual rows from there or from the cursor, so they only
+ * ever look at about a screen's worth of lines, however long the file or
+ * its lines are.
+ */
+
+/**
+ * Switches soft wrap mode on or off
+ */
+void editor_toggle_wrap() {
+    E.wrap    = !E.wrap;
+    E.wrapoff = 0;
+    E.coloff  = 0;
+    editor_set_status_message("Soft wrap %s", E.wrap ? "on" : "off");
+}
+
+/**
+ * Lays row out for the current screen width if it is not already, returns
+ * how many visual rows it takes. A visual row ends where the next character
+ * would not fit, and one whose last character ends right at the edge is
+ * followed by an empty one the cursor can go to at the end of the row
+ */
+int editor_row_wrap(erow * row) {
+    if (!editor_row_rendered(row)) {
+        editor_update_row(row);
+    }
+    if (row->wrap_cols == E.col) {
+        return row->nwraps;
+    }
+    pool_free(row->wraps, sizeof(int) * row->nwraps);
+    row->wraps = NULL;
+    if (row->chunks) { // Cut every E.col columns, only the window has a colmap
+        row->nwraps = editor_row_width(row) / E.col + 1;
+    }
+    else if (row->colmap == NULL) {
+        row->nwraps = row->rsize / E.col + 1;
+    }
+    else {
+        int * colmap = row->colmap;
+        for (int pass = 0; pass < 2; pass++) { // Count, then fill in
+            int n     = 1;
+            int start = 0; // Column the current visual row starts at
+            for (int b = 0; b < row->rsize; ) {
+                int e = b + 1; // Start of the next character
+                while (e < row->rsize && colmap[e] == colmap[b]) {
+                    e++;
+                }
+                if (colmap[e] - start > E.col && colmap[b] > start) {
+                    if (pass) {
+                        row->wraps[n] = b;
+                    }
+                    n++;
+                    start = colmap[b];
+                }
+                b = e;
+            }
+            if (colmap[row->rsize] - start >= E.col) {
+                if (pass) {
+                    row->wraps[n] = row->rsize;
+                }
+                n++;
+            }
+            if (pass == 0) {
+                row->nwraps   = n;
+                row->wraps    = pool_alloc(sizeof(int) * n);
+                row->wraps[0] = 0;
+            }
+        }
+    }
+    row->wrap_cols = E.col;
+    return row->nwraps;
+}
+
+/**
+ * Returns the render index visual row seg of row starts at
+ */
+int editor_row_wrap_start(erow * row, int seg) {
+    int nwraps = editor_row_wrap(row);
+
+    if (seg >= nwraps) {
+        seg = nwraps - 1;
+    }
+    if (row->chunks) {
+        return editor_row_rx_to_rbyte(row, seg * E.col);
+    }
+    return row->wraps ? row->wraps[seg] : seg * E.col;
+}
+
+/**
+ * Returns the visual row of row the render index rbyte is on
+ */
+int editor_row_wrap_seg(erow * row, int rbyte) {
+    int nwraps = editor_row_wrap(row);
+
+    if (row->wraps == NULL) {
+        int seg = editor_row_rbyte_to_rx(row, rbyte) / E.col;
+        return seg < nwraps ? seg : nwraps - 1;
+    }
+    int lo = 1; // First visual row starting past rbyte
+    int hi = nwraps;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (row->wraps[mid] <= rbyte) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+/**
+ * Returns how many visual rows line takes, the line past the end of the
+ * file takes one for the cursor
+ */
+int editor_wrap_rows(int line) {
+    erow * row = editor_row_at(line);
+
+    return row ? editor_row_wrap(row) : 1;
+}
+
+/**
+ * Moves visual row seg of line by n visual rows, down if n is positive and
+ * up if it is negative, stopping at either end of the file
+ */
+void editor_wrap_move(int * line, int * seg, int n) {
+    while (n > 0) {
+        int below = editor_wrap_rows(*line) - 1 - *seg; // Visual rows left in this line
+        if (n <= below) {
+            *seg += n;
+            return;
+        }
+        if (*line >= E.numrows) {
+            *seg += below;
+            return;
+        }
+        n -= below + 1;
+        (*line)++;
+        *seg = 0;
+    }
+    while (n < 0) {
+        if (-n <= *seg) {
+            *seg += n;
+            return;
+        }
+        if (*line == 0) {
+            *seg = 0;
+            return;
+        }
+        n += *seg + 1;
+        (*line)--;
+        *seg = editor_wrap_rows(*line) - 1;
+    }
+}
+
+/**
+ * Counts the visual rows from visual row seg of line down to visual row
+ * to_seg of to_line, stopping at limit
+ */
+int editor_wrap_distance(int line, int seg, int to_line, int to_seg, int limit) {
+    int d = -seg;
+
+    for ( ; line < to_line && d < limit; line++) {
+        d += editor_wrap_rows(line);
+    }
+    d += to_seg;
+    return d < limit ? d : limit;
+}
+
+/**
+ * Scrolls by visual rows so the cursor stays on screen, E.coloff becomes
+ * the column the visual row of the cursor starts at
+ */
+void editor_wrap_scroll() {
+    erow * row = editor_row_at(E.cy);
+    int seg    = row ? editor_row_wrap_seg(row, editor_row_cx_to_rbyte(row, E.cx)) : 0;
+    int rows   = editor_wrap_rows(E.rowoff);
+
+    if (E.wrapoff >= rows) { // Line rowoff got shorter
+        E.wrapoff = rows - 1;
+    }
+    if (E.cy < E.rowoff || (E.cy == E.rowoff && seg < E.wrapoff)) {
+        E.rowoff  = E.cy;
+        E.wrapoff = seg;
+    }
+    E.wrap_y = editor_wrap_distance(E.rowoff, E.wrapoff, E.cy, seg, E.row);
+    if (E.wrap_y >= E.row) { // Put the cursor on the last line of the screen
+        E.rowoff  = E.cy;
+        E.wrapoff = seg;
+        editor_wrap_move(&E.rowoff, &E.wrapoff, -(E.row - 1));
+        E.wrap_y  = E.row - 1;
+    }
+    E.coloff = row ? editor_row_rbyte_to_rx(row, editor_row_wrap_start(row, seg)) : 0;
+}
+
+/**
+ * Moves the cursor to n visual rows below the top of the screen, or above
+ * it if n is negative, keeping its column on screen
+ */
+void editor_wrap_page(int n) {
+    int line = E.rowoff;
+    int seg  = E.wrapoff;
+    int x    = E.rx - E.coloff;
+
+    editor_wrap_move(&line, &seg, n);
+    erow * row = editor_row_at(line);
+    E.cy = row ? line : E.numrows;
+    E.cx = row ? editor_row_rx_to_cx(row, editor_row_rbyte_to_rx(row, editor_row_wrap_start(row, seg)) + x) : 0;
+}
+
+/********************************
+* Syntax Highlighting
+********************************/
+
+/**
+ * Goes through the characters of an erow and highlights them if needed
+ */
+void editor_update_syntax(erow * row) {
+    row->flags |= ROW_HL_VALID;
+    row->flags &= ~(ROW_HL_GUESS | ROW_HL_ENDS);
+    if (row->flags & ROW_HL_STALE) {
+        row->flags &= ~ROW_HL_STALE;
+        E.hl_stale_rows--;
+    }
+    if (E.syntax == NULL) {
+        memset(row->hl, HL_NORMAL, row->rsize);
+        return;
+    }
+    int state = editor_syntax_row_state(row);
+    int end_state;
+    erow * next = editor_row_next(row);
+    if (row->chunks) { // Only the window is highlighted, from the state its first chunk starts in
+        // The states past the window are found later, see editor_syntax_finish()
+        int first = editor_chunk_find(row, row->win_start);
+        int end   = editor_chunks_highlight(row, state, first);
+        editor_syntax_window(row, row->chunks->c[first].state);
+        end_state = (end < 0) ? row->hl_end_state : editor_syntax_carry(end);
+        if (end == -2 && next && (next->flags & (ROW_HL_VALID | ROW_HL_ENDS)) && row != E.hl_long) {
+            if (E.hl_long) { // Only one row is left for later
+                editor_syntax_finish(0);
+            }
+            E.hl_long = row;
+        }
+    }
+    else {
+        end_state = editor_syntax_carry(editor_syntax_scan(row->render, row->rsize, row->rsize, row->hl, state));
+    }
+    if (row->hl_end_state != end_state && next && (next->flags & (ROW_HL_VALID | ROW_HL_ENDS))) {
+        editor_syntax_stale(next);
+    }
+    row->hl_end_state = end_state;
+}
+
+/**
+ * Highlights the window of a long row from state, looking on into the chars
+ * past it to finish a token that crosses its end
+ */
+void editor_syntax_window(erow * row, int state) {
+    int extra = (row->size - row->win_end < HL_LOOKAHEAD) ? row->size - row->win_end : HL_LOOKAHEAD;
+    char * buf = malloc(row->rsize + extra + 1);
+
+    memcpy(buf, row->render, row->rsize);
+    for (int i = 0; i < extra; i++) {
+        buf[row->rsize + i] = ROW_CHAR(row, row->win_end + i);
+    }
+    buf[row->rsize + extra] = '\0';
+    editor_syntax_scan(buf, row->rsize, row->rsize + extra, row->hl, state);
+    free(buf);
+}
+
+/**
+ * Finds the states of the chunks of E.hl_long past its window, a row below
+ * it being highlighted already, and flags that row stale if the long one
+ * now ends differently. With idle set it stops as soon as a key is pending,
+ * to go on the next time, so typing into a long row never waits for the
+ * rest of it to be scanned. Returns whether rows need drawing again
+ */
+int editor_syntax_finish(int idle) {
+    erow * row = E.hl_long;
+
+    if (row == NULL) {
+        return 0;
+    }
+    struct row_chunks * ch = row->chunks;
+    if (!(row->flags & ROW_HL_VALID) || ch->syntax != E.syntax) { // Highlighting it again leaves it here anew
+        E.hl_long = NULL;
+        return 0;
+    }
+    int end = -2;
+    while (end == -2 && !(idle && editor_input_wait(0))) {
+        end = editor_chunks_highlight(row, ch->c[0].state, ch->hl_first + HL_IDLE_CHUNKS);
+    }
+    if (end == -2) {
+        return 0;
+    }
+    E.hl_long = NULL;
+    if (end == -1 || editor_syntax_carry(end) == row->hl_end_state) {
+        return 0;
+    }
+    row->hl_end_state = editor_syntax_carry(end);
+    erow * next       = editor_row_next(row);
+    if (next && (next->flags & (ROW_HL_VALID | ROW_HL_ENDS))) {
+        editor_syntax_stale(next);
+    }
+    return 1;
+}
+
+/**
+ * Finds only the state row ends in, scanning its chars without rendering
+ * it: tabs change no state, see "Background Highlighting". Long rows and
+ * rows with the gap in the middle are highlighted in full instead
+ */
+void editor_syntax_row_end(erow * row) {
+    if (E.syntax == NULL || row->size >= ROW_LONG_SIZE || (row->gap_len && row->gap_start < row->size)) {
+        if (!editor_row_rendered(row)) {
+            editor_update_row(row);
+        }
+        editor_update_syntax(row);
+        return;
+    }
+    row->flags &= ~ROW_HL_GUESS;
+    if (row->flags & ROW_HL_STALE) {
+        row->flags &= ~ROW_HL_STALE;
+        E.hl_stale_rows--;
+    }
+    int state     = editor_syntax_row_state(row);
+    int end_state = editor_syntax_carry(editor_syntax_scan(row->chars, row->size, row->size, NULL, state));
+    erow * next   = editor_row_next(row);
+    if (row->hl_end_state != end_state && next && (next->flags & (ROW_HL_VALID | ROW_HL_ENDS))) {
+        editor_syntax_stale(next);
+    }
+    row->hl_end_state = end_state;
+    row->flags       |= ROW_HL_ENDS;
+}
+
+/*
+ * Opening or closing a region that spans rows, such as a multiline comment,
+ * changes how every row after it starts, possibly down to the end of the
+ * file. Rather than highlighting them all again on the spot, the row after
+ * is only flagged stale, and E.hl_stale keeps the first such row. Rows are highlighted again when they
+ * are prepared, which editor_draw_rows() does for the rows on screen, top
+ * to bottom, each flagging the next if it now ends differently, so a
+ * keystroke costs a screen of rows at most and the flags stop spreading as
+ * soon as a row ends the same as before. A row prepared further down, after
+ * a jump, first walks from E.hl_stale over the rows in between, highlighting
+ * only those flagged.
+ */
+
+/**
+ * Flags row to be highlighted again the next time it is prepared, the row
+ * before it now ends differently
+ */
+void editor_syntax_stale(erow * row) {
+    row->flags &= ~(ROW_HL_VALID | ROW_HL_ENDS);
+    if (E.pager) { // Only refreshed if it comes into view again
+        return;
+    }
+    if (!(row->flags & ROW_HL_STALE)) {
+        row->flags |= ROW_HL_STALE;
+        E.hl_stale_rows++;
+    }
+    if (E.hl_stale == NULL || editor_row_index(row) < editor_row_index(E.hl_stale)) {
+        E.hl_stale = row;
+    }
+}
+
+/**
+ * Returns the highlighter state a row starts in. A row whose previous row is
+ * not highlighted takes the state the worker found, or else is flagged
+ * ROW_HL_GUESS while the worker may still find it
+ */
+int editor_syntax_row_state(erow * row) {
+    erow * prev = editor_row_prev(row);
+
+    if (prev && prev->chunks && prev->chunks->hl_last >= 0 && (prev->flags & ROW_HL_VALID)) {
+        // A long row whose states were only found up to its window
+        int end = editor_chunks_highlight(prev, editor_syntax_row_state(prev), prev->chunks->n);
+        if (end >= 0) {
+            prev->hl_end_state = editor_syntax_carry(end);
+        }
+    }
+    if (prev == NULL) {
+        return HL_DFA_SEP;
+    }
+    if (!(prev->flags & (ROW_HL_VALID | ROW_HL_ENDS))) {
+        int state = editor_hl_worker_state(row);
+        if (state >= 0) {
+            return state;
+        }
+        if (E.hl_worker.running) {
+            row->flags |= ROW_HL_GUESS;
+        }
+    }
+    else if (prev->flags & ROW_HL_GUESS) {
+        row->flags |= ROW_HL_GUESS;
+    }
+    return prev->hl_end_state;
+}
+
+/**
+ * Returns the state the row after a row that ends in state starts in: the
+ * region it ends in if that goes on past the end of the row, else
+ * HL_DFA_SEP
+ */
+int editor_syntax_carry(int state) {
+    int at = state & HL_STATE_DFA;
+
+    if (at >= HL_DFA_REGION && (E.syntax->regions[at - HL_DFA_REGION].flags & HL_REGION_MULTILINE)) {
+        return at;
+    }
+    return HL_DFA_SEP;
+}
+
+/**
+ * Highlights the len bytes at s into hl, starting in state, and returns the
+ * state it ends in. Up to avail bytes are looked at to finish a token, hl
+ * may be NULL when only the state is wanted
+ */
+int editor_syntax_scan(const char * s, int len, int avail, unsigned char * hl, int state) {
+    struct hl_lexer * lexer  = E.syntax->lexer;
+    struct hl_region * regions = E.syntax->regions;
+    int at    = state & HL_STATE_DFA;
+    int token = HL_STATE_SKIP_HL(state); // Highlight of the last token, for one that runs past len
+    int i     = HL_STATE_SKIP_LEN(state);
+
+    if (hl) {
+        memset(hl, HL_NORMAL, len);
+        memset(hl, token, i < len ? i : len);
+    }
+    while (i < len) {
+        if (at >= HL_DFA_REGION && regions[at - HL_DFA_REGION].end == NULL) { // Runs to the end of the line
+            if (hl) {
+                memset(&hl[i], regions[at - HL_DFA_REGION].hl, len - i);
+            }
+            i = len;
+            break;
+        }
+        unsigned char c = s[i];
+        struct hl_move * m = &lexer->moves[at * lexer->nclasses + lexer->classes[c]];
+        if (m->next == at && !m->act && lexer->runs[at].nranges && len >= RUN_SCAN_WIDTH) {
+            int n = editor_syntax_run(&lexer->runs[at], s, i, len);
+            if (n) {
+                if (hl && lexer->runs[at].hl != HL_NORMAL) { // Already cleared to HL_NORMAL
+                    memset(&hl[i], lexer->runs[at].hl, n);
+                }
+                i += n;
+                continue;
+            }
+        }
+        if (m->act) {
+            int n = 0; // Bytes of the token found here, if any
+            int next = at;
+            if (m->act & HL_ACT_OPEN) {
+                for (int r = 0; regions[r].start; r++) {
+                    n = lexer->start_len[r];
+                    if ((unsigned char)regions[r].start[0] == c && i + n <= avail && !memcmp(&s[i], regions[r].start, n) &&
+                      (at == HL_DFA_SEP || !(regions[r].flags & HL_REGION_AFTER_SEP)))
+                    {
+                        token = regions[r].hl;
+                        next  = HL_DFA_REGION + r;
+                        break;
+                    }
+                    n = 0;
+                }
+            }
+            else if ((m->act & HL_ACT_ESCAPE) && i + 1 < avail) {
+                token = m->hl;
+                n     = 2;
+            }
+            else if (m->act & HL_ACT_CLOSE) {
+                struct hl_region * r = &regions[at - HL_DFA_REGION];
+                n = lexer->end_len[at - HL_DFA_REGION];
+                if (i + n <= avail && !memcmp(&s[i], r->end, n)) {
+                    token = r->hl;
+                    next  = HL_DFA_SEP;
+                }
+                else {
+                    n = 0;
+                }
+            }
+            if (n == 0 && (m->act & HL_ACT_KEYWORD)) {
+                int klen = 0; // Length of the word starting here
+                while (klen <= lexer->keyword_max && i + klen < avail && !lexer->separator[(unsigned char)s[i + klen]]) {
+                    klen++;
+                }
+                int kw = editor_syntax_keyword(lexer, &s[i], klen);
+                if (kw != HL_NORMAL) {
+                    token = kw;
+                    n     = klen;
+                    next  = HL_DFA_WORD;
+                }
+            }
+            if (n) {
+                if (hl) {
+                    memset(&hl[i], token, (len - i < n) ? len - i : n);
+                }
+                i += n;
+                at = next;
+                continue;
+            }
+        }
+        if (hl) {
+            hl[i] = m->hl;
+        }
+        at = m->next;
+        i++;
+    }
+    return at | (i > len ? HL_STATE_SKIP(i - len, token) : 0);
+} /* editor_syntax_scan */
+
+/**
+ * Returns a bit mask of which of the RUN_SCAN_WIDTH bytes at s fall in one
+ * of the ranges of run
+ */
+unsigned int editor_syntax_run_mask(const struct hl_run * run, const char * s) {
+#if defined(__AVX2__)
+    __m256i v  = _mm256_loadu_si256((const __m256i *)s);
+    __m256i in = _mm256_setzero_si256();
+    for (int r = 0; r < HL_RUN_RANGES; r++) {
+        __m256i d = _mm256_sub_epi8(v, _mm256_loadu_si256((const __m256i *)run->lo[r]));
+        in = _mm256_or_si256(in, _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_loadu_si256((const __m256i *)run->span[r])), d));
+    }
+    return _mm256_movemask_epi8(in);
+#elif defined(__SSE2__)
+    __m128i v  = _mm_loadu_si128((const __m128i *)s);
+    __m128i in = _mm_setzero_si128();
+    for (int r = 0; r < HL_RUN_RANGES; r++) {
+        __m128i d = _mm_sub_epi8(v, _mm_loadu_si128((const __m128i *)run->lo[r]));
+        in = _mm_or_si128(in, _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_loadu_si128((const __m128i *)run->span[r])), d));
+    }
+    return _mm_movemask_epi8(in);
+#else
+    unsigned int mask = 0;
+    for (int i = 0; i < RUN_SCAN_WIDTH; i++) {
+        for (int r = 0; r < HL_RUN_RANGES; r++) {
+            mask |= (unsigned int)((unsigned char)(s[i] - run->lo[r][0]) <= run->span[r][0]) << i;
+        }
+    }
+    return mask;
+#endif
+}
+
+/**
+ * Returns how many of the bytes at s from from to len are in a run of run.
+ * len must be at least RUN_SCAN_WIDTH: the last bytes are looked at with a
+ * vector ending at len, that overlaps the ones before
+ */
+int editor_syntax_run(const struct hl_run * run, const char * s, int from, int len) {
+    unsigned int full = (RUN_SCAN_WIDTH == 32) ? ~0u : (1u << RUN_SCAN_WIDTH) - 1;
+    int i = from;
+
+    for ( ; i + RUN_SCAN_WIDTH <= len; i += RUN_SCAN_WIDTH) {
+        unsigned int mask = editor_syntax_run_mask(run, &s[i]);
+        if (mask != full) {
+            return i - from + __builtin_ctz(~mask);
+        }
+    }
+    if (i < len) { // The bits of the bytes before i are shifted out, those past len are 0
+        unsigned int mask = editor_syntax_run_mask(run, &s[len - RUN_SCAN_WIDTH]) >> (RUN_SCAN_WIDTH - (len - i));
+        i += __builtin_ctz(~mask);
+    }
+    return i - from;
+}
+
+/*
+ * A syntax is compiled into a lexer the first time it is selected. The
+ * lexer is a DFA over the bytes of a row: a separator, a word, a number, or
+ * one state for each region of the syntax, which it is in until the region
+ * closes. Each byte leads from a state to the next one and gets its
+ * highlight from a single table lookup, and bytes that every state treats
+ * alike share a class, so the table holds a row per state and a column per
+ * class rather than one per byte, and stays in cache.
+ *
+ * A move may also name checks to make first, for the few bytes that could
+ * start something longer than themselves: the first byte of a delimiter
+ * opening or closing a region, a backslash that escapes the byte after it,
+ * or the first byte of a word that might be a keyword. Only those compare
+ * bytes past the one at hand, everything else takes the move as is.
+ *
+ * Most bytes don't even change the state: the rest of a word, the inside of
+ * a comment or a string, indentation. Each state also gets a few ranges of
+ * such bytes, the longest runs of byte values that keep it as is with the
+ * same highlight, weighted towards letters, digits and whitespace, and the
+ * lexer skips over them RUN_SCAN_WIDTH bytes at a time with SSE2/AVX2
+ * range compares rather than a lookup per byte.
+ *
+ * The state a row ends in is all the next row needs to be highlighted on
+ * its own, see editor_syntax_carry(), so editing a row of any syntax only
+ * highlights the rows after it again while they start differently.
+ */
+
+/**
+ * Returns the move of lexer on byte c in state at, for syntax
+ */
+struct hl_move editor_syntax_move(struct editor_syntax * syntax, struct hl_lexer * lexer, int at, int c) {
+    struct hl_move m = { at, HL_NORMAL, 0 };
+
+    if (at >= HL_DFA_REGION) {
+        struct hl_region * r = &syntax->regions[at - HL_DFA_REGION];
+        m.hl = r->hl;
+        if ((r->flags & HL_REGION_ESCAPES) && c == '\\') {
+            m.act |= HL_ACT_ESCAPE;
+        }
+        if (r->end && c == (unsigned char)r->end[0]) {
+            m.act |= HL_ACT_CLOSE;
+        }
+        return m;
+    }
+    for (struct hl_region * r = syntax->regions; r->start; r++) {
+        if (c == (unsigned char)r->start[0] && (at == HL_DFA_SEP || !(r->flags & HL_REGION_AFTER_SEP))) {
+            m.act |= HL_ACT_OPEN;
+        }
+    }
+    int digit = (syntax->flags & HL_HIGHLIGHT_NUMBERS) && isdigit(c);
+    if ((at == HL_DFA_SEP && digit) || (at == HL_DFA_NUMBER && (digit || c == '.'))) {
+        m.next = HL_DFA_NUMBER;
+        m.hl   = HL_NUMBER;
+    }
+    else if (lexer->separator[c]) {
+        m.next = HL_DFA_SEP;
     }
     else {
-        E.cx     = saved_cx;
-        E.cy     = saved_cy;
-        E.coloff = saved_coloff;
-        E.rowoff = saved_rowoff;
+        m.next = HL_DFA_WORD;
+        if (at == HL_DFA_SEP) {
+            m.act |= HL_ACT_KEYWORD;
+        }
+    }
+    return m;
+}
+
+/**
+ * Gives syntax its lexer, read from its cache if that is still current,
+ * compiled otherwise
+ */
+void editor_syntax_lexer(struct editor_syntax * syntax) {
+    if (syntax->cache && editor_syntax_cache_read(syntax) == 0) {
+        return;
+    }
+    editor_syntax_compile(syntax);
+    if (syntax->cache) {
+        editor_syntax_cache_write(syntax);
+    }
+}
+
+/**
+ * Returns whether byte c ends a word in syntax, the hot path looks it up in
+ * the separator table of its lexer instead
+ */
+int editor_syntax_is_separator(struct editor_syntax * syntax, int c) {
+    return isspace(c) || c == '\0' || strchr(syntax->separators ? syntax->separators : HL_SEPARATORS, c) != NULL;
+}
+
+/**
+ * Fills in the parts of lexer that follow directly from syntax: its states,
+ * separators and the lengths of its delimiters and keywords
+ */
+void editor_syntax_init_lexer(struct editor_syntax * syntax, struct hl_lexer * lexer) {
+    int nregions = 0;
+
+    while (syntax->regions[nregions].start && nregions < HL_REGIONS_MAX) {
+        struct hl_region * r = &syntax->regions[nregions];
+        lexer->start_len[nregions] = strlen(r->start);
+        lexer->end_len[nregions]   = r->end ? strlen(r->end) : 0;
+        lexer->multiline |= (r->flags & HL_REGION_MULTILINE) != 0;
+        nregions++;
+    }
+    lexer->nstates = HL_DFA_REGION + nregions;
+    for (int c = 0; c < 256; c++) {
+        lexer->separator[c] = editor_syntax_is_separator(syntax, c);
+    }
+    lexer->keyword_max = 0;
+    for (char ** k = syntax->keywords; *k; k++) {
+        int klen = strlen(*k) - ((*k)[strlen(*k) - 1] == '|');
+        if (klen > lexer->keyword_max) {
+            lexer->keyword_max = klen;
+        }
+    }
+}
+
+/**
+ * Builds the lexer of syntax from its regions, separators and keywords
+ */
+void editor_syntax_compile(struct editor_syntax * syntax) {
+    struct hl_lexer * lexer = calloc(1, sizeof(struct hl_lexer));
+    struct hl_move moves[256][HL_DFA_REGION + HL_REGIONS_MAX]; // Every move of each byte
+
+    editor_syntax_init_lexer(syntax, lexer);
+    for (int c = 0; c < 256; c++) {
+        for (int at = 0; at < lexer->nstates; at++) {
+            moves[c][at] = editor_syntax_move(syntax, lexer, at, c);
+        }
+        int k = 0; // First byte with the same moves
+        while (k < c && memcmp(moves[k], moves[c], lexer->nstates * sizeof(struct hl_move))) {
+            k++;
+        }
+        lexer->classes[c] = (k < c) ? lexer->classes[k] : lexer->nclasses++;
+    }
+    lexer->moves = malloc(lexer->nstates * lexer->nclasses * sizeof(struct hl_move));
+    for (int c = 0; c < 256; c++) {
+        for (int at = 0; at < lexer->nstates; at++) {
+            lexer->moves[at * lexer->nclasses + lexer->classes[c]] = moves[c][at];
+        }
+    }
+    syntax->lexer = lexer;
+    editor_syntax_compile_runs(lexer);
+    editor_syntax_compile_keywords(syntax);
+} /* editor_syntax_compile */
+
+/**
+ * Finds the ranges of bytes each state of lexer skips over: the runs of
+ * byte values whose move keeps the state as is, with no checks to make and
+ * the same highlight, scored by how often they turn up in text
+ */
+void editor_syntax_compile_runs(struct hl_lexer * lexer) {
+    lexer->runs = calloc(lexer->nstates, sizeof(struct hl_run));
+    for (int at = 0; at < lexer->nstates; at++) {
+        struct hl_run * run = &lexer->runs[at];
+        struct hl_move * moves = &lexer->moves[at * lexer->nclasses];
+        int from[HL_RUN_RANGES]  = { 0 };
+        int span[HL_RUN_RANGES]  = { 0 };
+        int score[HL_RUN_RANGES] = { 0 };
+        int found = 0; // Some byte keeps the state
+        for (int c = 0; c < 256; ) {
+            struct hl_move * m = &moves[lexer->classes[c]];
+            if (m->next != at || m->act || (found && m->hl != run->hl)) {
+                c++;
+                continue;
+            }
+            run->hl = m->hl;
+            found   = 1;
+            int lo  = c;
+            int n   = 0; // Score of the run from lo
+            for ( ; c < 256; c++) {
+                m = &moves[lexer->classes[c]];
+                if (m->next != at || m->act || m->hl != run->hl) {
+                    break;
+                }
+                n += (c == ' ' || c == '\t') ? 16 : (isprint(c) || c >= 0x80);
+            }
+            int r = run->nranges; // Keep the best runs, best first
+            while (r > 0 && score[r - 1] < n) {
+                if (r < HL_RUN_RANGES) {
+                    from[r]  = from[r - 1];
+                    span[r]  = span[r - 1];
+                    score[r] = score[r - 1];
+                }
+                r--;
+            }
+            if (r < HL_RUN_RANGES && n > 0) {
+                from[r]  = lo;
+                span[r]  = c - 1 - lo;
+                score[r] = n;
+                if (run->nranges < HL_RUN_RANGES) {
+                    run->nranges++;
+                }
+            }
+        }
+        for (int r = 0; r < HL_RUN_RANGES; r++) { // Slots left over repeat the best range
+            int k = (r < run->nranges) ? r : 0;
+            memset(run->lo[r], from[k], RUN_SCAN_WIDTH);
+            memset(run->span[r], span[k], RUN_SCAN_WIDTH);
+        }
+    }
+} /* editor_syntax_compile_runs */
+
+/*
+ * Keywords are looked up in a perfect hash table built once per syntax: the
+ * seed of the hash is picked so that no two keywords share a slot, so the
+ * word at hand is classified by hashing it and comparing it with the one
+ * keyword in its slot, however many keywords the syntax has.
+ */
+
+/**
+ * Returns the FNV-1a hash of the len bytes at s, mixed with seed
+ */
+unsigned int keyword_hash(const char * s, int len, unsigned int seed) {
+    unsigned int h = 2166136261u ^ seed;
+
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Builds the keyword table of the lexer of syntax from its keywords, those
+ * ending in '|' are highlighted as HL_KEYWORD2. Keywords are whole words,
+ * they may not hold a separator, and are listed once, see
+ * editor_syntax_parse(). Should no seed fit them in HL_KEYWORD_SLOTS slots
+ * the last table tried is kept, without the keywords that still collide
+ */
+void editor_syntax_compile_keywords(struct editor_syntax * syntax) {
+    struct hl_lexer * lexer = syntax->lexer;
+    int n = 0;
+
+    while (syntax->keywords[n]) {
+        n++;
+    }
+    unsigned int size = 1;
+    while (size < 2 * (unsigned int)n) {
+        size *= 2;
+    }
+    for (unsigned int seed = 0; ; seed++) {
+        if (seed > 0 && seed % 256 == 0) { // Too crowded to find one, make room
+            size *= 2;
+        }
+        int last = (size >= HL_KEYWORD_SLOTS && seed % 256 == 255);
+        struct hl_keyword * table = calloc(size, sizeof(struct hl_keyword));
+        int k;
+        for (k = 0; k < n; k++) {
+            char * word = syntax->keywords[k];
+            int klen    = strlen(word);
+            int kw2     = (word[klen - 1] == '|');
+            struct hl_keyword * slot = &table[keyword_hash(word, klen - kw2, seed) & (size - 1)];
+            if (slot->word && !last) {
+                break;
+            }
+            if (slot->word == NULL) {
+                editor_syntax_keyword_slot(slot, word);
+            }
+        }
+        if (k == n) {
+            lexer->keyword_table = table;
+            lexer->keyword_mask  = size - 1;
+            lexer->keyword_seed  = seed;
+            return;
+        }
+        free(table);
+    }
+}
+
+/**
+ * Puts keyword word, as it is listed in a syntax, in slot
+ */
+void editor_syntax_keyword_slot(struct hl_keyword * slot, const char * word) {
+    int klen   = strlen(word);
+    int kw2    = (word[klen - 1] == '|');
+    slot->word = word;
+    slot->len  = klen - kw2;
+    slot->hl   = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+}
+
+/**
+ * Returns HL_KEYWORD1 or HL_KEYWORD2 if the len bytes at s are a keyword of
+ * lexer, HL_NORMAL if not
+ */
+int editor_syntax_keyword(struct hl_lexer * lexer, const char * s, int len) {
+    if (len == 0 || len > lexer->keyword_max) {
+        return HL_NORMAL;
+    }
+    struct hl_keyword * slot = &lexer->keyword_table[keyword_hash(s, len, lexer->keyword_seed) & lexer->keyword_mask];
+    if (slot->len == len && !memcmp(slot->word, s, len)) {
+        return slot->hl;
+    }
+    return HL_NORMAL;
+}
+
+/**
+ * Matches the current filename to one of the filematch fields,
+ * if a match is found, sets E.syntax to that filetype. Syntaxes read from
+ * syntax files are tried before the built-in ones
+ */
+void editor_select_syntax_highlight() {
+    editor_hl_worker_stop(); // It reads E.syntax
+    E.syntax = NULL;
+    for (erow * row = row_tree_first(); row; row = row_tree_next(row)) {
+        row->flags &= ~(ROW_HL_VALID | ROW_HL_ENDS);
+    }
+    if (E.filename == NULL) {
+        return;
+    }
+    char * ext = strrchr(E.filename, '.');
+    for (unsigned int i = 0; i < E.nsyntaxes + HLDB_ENTRIES; i++) {
+        struct editor_syntax * s = (i < (unsigned int)E.nsyntaxes) ? &E.syntaxes[i] : &HLDB[i - E.nsyntaxes];
+        unsigned int j = 0;
+        while (s->filematch[j]) {
+            int is_ext = (s->filematch[j][0] == '.');
+            if ((is_ext && ext && !strcmp(ext, s->filematch[j])) ||
+              (!is_ext && strstr(E.filename, s->filematch[j])))
+            {
+                if (s->lexer == NULL) {
+                    editor_syntax_lexer(s);
+                }
+                E.syntax = s;
+                editor_hl_worker_start();
+                return;
+            }
+            j++;
+        }
+    }
+}
+
+/**
+ * Maps values in hl to the actual ANSI color codes that characters should
+ * be drawn in
+ */
+int editor_syntax_to_color(int hl) {
+    switch (hl) {
+        case HL_COMMENT:
+        case HL_MLCOMMENT:
+            return 36;
+
+        case HL_KEYWORD1:
+            return 33;
+
+        case HL_KEYWORD2:
+            return 32;
+
+        case HL_STRING:
+            return 35;
+
+        case HL_NUMBER:
+            return 31;
+
+        case HL_MATCH:
+            return 34;
+
+        default:
+            return 37;
     }
 }
 
+
+/********************************
+* Syntax Files
+********************************/
+
+/*
+ * Besides the built-in HLDB, syntaxes are read at startup from the files
+ * ending in ".syntax" in $TEDITOR_SYNTAX_DIR, ~/.teditor/syntax by default.
+ * They are tried before the built-in ones, in the order of their names, so
+ * a file may also replace a built-in syntax. A file holds one directive per
+ * line, blank lines and lines starting with '#' are skipped:
+ *
+ *   filetype python
+ *   match .py .pyw
+ *   keywords def class if else return
+ *   types int str None
+ *   separators ,.()[]{}:;=+-<>
+ *   numbers on
+ *   region # - comment
+ *   region """ """ string escapes multiline
+ *   region " " string escapes
+ *
+ * keywords are highlighted as HL_KEYWORD1 and types as HL_KEYWORD2. A
+ * region gives the delimiters that open and close it, "-" for one that
+ * runs to the end of the line, its highlight, one of comment, mlcomment or
+ * string, and any of escapes, multiline and after-sep, see struct
+ * hl_region. Regions are tried in the order they are given.
+ *
+ * Reading a file is cheap, compiling it into a lexer is not, mostly for
+ * finding the seed of its keyword table, so a syntax is only compiled the
+ * first time it is selected and its lexer is then cached in
+ * $TEDITOR_CACHE_DIR, ~/.cache/teditor by default. A cache holds the hash
+ * of the file it was compiled from, and is compiled again once that no
+ * longer matches.
+ */
+
 /**
- * Loops through rows of a file and if a row contains the query string,
- * move the cursor to the match, allows for iterative search
+ * Reads the syntax files from the directories named by the environment,
+ * see "Syntax Files"
  */
-void editor_find_callback(char * query, int key) {
-    static int last_match = -1;
-    static int direction  = 1;
-    static int saved_hl_line;
-    static char * saved_hl = NULL;
+void editor_init_syntaxes() {
+    char * home      = getenv("HOME");
+    char * dir       = getenv("TEDITOR_SYNTAX_DIR");
+    char * cache_dir = getenv("TEDITOR_CACHE_DIR");
+    char * paths[2]  = { NULL, NULL };
 
-    if (saved_hl) {
-        memcpy(E.editor_row[saved_hl_line].hl, saved_hl, E.editor_row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
+    if (home && dir == NULL) {
+        paths[0] = malloc(strlen(home) + 32);
+        snprintf(paths[0], strlen(home) + 32, "%s/.teditor/syntax", home);
+        dir = paths[0];
     }
-    if (key == '\r' || key == '\x1b') {
-        last_match = -1;
-        direction  = 1;
+    if (home && cache_dir == NULL) {
+        paths[1] = malloc(strlen(home) + 32);
+        snprintf(paths[1], strlen(home) + 32, "%s/.cache/teditor", home);
+        cache_dir = paths[1];
+    }
+    if (dir) {
+        editor_load_syntaxes(dir, cache_dir);
+    }
+    free(paths[0]);
+    free(paths[1]);
+}
+
+/**
+ * Reads every syntax file in dir into E.syntaxes, their lexers are cached
+ * in cache_dir, or not at all if it is NULL
+ */
+void editor_load_syntaxes(const char * dir, const char * cache_dir) {
+    struct dirent ** names;
+    int n = scandir(dir, &names, NULL, alphasort);
+
+    if (n == -1) { // No syntax files
         return;
     }
-    else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
+    for (int i = 0; i < n; i++) {
+        char * name = names[i]->d_name;
+        int len     = strlen(name);
+        if (len > 7 && !strcmp(name + len - 7, ".syntax")) {
+            char * path = malloc(strlen(dir) + len + 2);
+            sprintf(path, "%s/%s", dir, name);
+            editor_load_syntax(path, cache_dir);
+            free(path);
+        }
+        free(names[i]);
     }
-    else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
+    free(names);
+}
+
+/**
+ * Reads the syntax file at path and adds it to E.syntaxes. Returns -1 and
+ * sets the status message if it can't be read, is larger than
+ * HL_SYNTAX_FILE_MAX or is not valid
+ */
+int editor_load_syntax(const char * path, const char * cache_dir) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        editor_set_status_message("Can't read syntax file %s: %s", path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
     }
-    else {
-        last_match = -1;
-        direction  = 1;
+    char * text = (st.st_size <= HL_SYNTAX_FILE_MAX) ? malloc(st.st_size + 1) : NULL;
+    if (text == NULL) {
+        editor_set_status_message("%s: syntax files may not be larger than %d bytes", path, HL_SYNTAX_FILE_MAX);
+        close(fd);
+        return -1;
     }
+    ssize_t len = 0;
+    ssize_t n;
+    while (len < st.st_size && (n = read(fd, text + len, st.st_size - len)) > 0) {
+        len += n;
+    }
+    close(fd);
+    text[len] = '\0';
 
-    if (last_match == -1) {
-        direction = 1;
+    struct editor_syntax syntax;
+    unsigned int key = keyword_hash(text, len, 0); // Before parsing cuts text up
+    if (editor_syntax_parse(&syntax, text, len, path) == -1) {
+        free(text);
+        return -1;
+    }
+    free(text);
+    if (cache_dir) {
+        syntax.cache = malloc(strlen(cache_dir) + strlen(syntax.filetype) + 8);
+        sprintf(syntax.cache, "%s/%s.lexer", cache_dir, syntax.filetype);
+        syntax.cache_key = key;
+    }
+    E.syntaxes = realloc(E.syntaxes, sizeof(struct editor_syntax) * (E.nsyntaxes + 1));
+    E.syntaxes[E.nsyntaxes++] = syntax;
+    return 0;
+}
+
+/**
+ * Reads the len bytes of text, the contents of the syntax file name, into
+ * syntax. Returns -1 and sets the status message if it is not valid. text
+ * is cut up in the process
+ */
+int editor_syntax_parse(struct editor_syntax * syntax, char * text, int len, const char * name) {
+    const char * error = NULL;
+    char message[80];     // For errors that name a limit
+    int lineno    = 0;
+    int nmatch    = 0;
+    int nkeywords = 0;
+    int nregions  = 0;
+    char * line   = text;
+
+    memset(syntax, 0, sizeof(struct editor_syntax));
+    syntax->filematch = calloc(1, sizeof(char *));
+    syntax->keywords  = calloc(1, sizeof(char *));
+    syntax->regions   = calloc(HL_REGIONS_MAX + 1, sizeof(struct hl_region));
+    syntax->flags     = HL_HIGHLIGHT_NUMBERS;
+    while (line < text + len && error == NULL) {
+        char * eol = memchr(line, '\n', text + len - line);
+        if (eol == NULL) {
+            eol = text + len;
+        }
+        *eol = '\0';
+        lineno++;
+        char * save;
+        char * directive = strtok_r(line, " \t\r", &save);
+        char * arg       = strtok_r(NULL, " \t\r", &save);
+        line = eol + 1;
+        if (directive == NULL || directive[0] == '#') {
+            continue;
+        }
+        if (!strcmp(directive, "filetype") && arg) {
+            free(syntax->filetype);
+            syntax->filetype = strdup(arg);
+            for (char * c = arg; *c; c++) { // It names the cache file
+                if (!isalnum((unsigned char)*c) && !strchr("_+-", *c)) {
+                    error = "filetype may only hold letters, digits, '_', '+' and '-'";
+                }
+            }
+        }
+        else if (!strcmp(directive, "match")) {
+            for (; arg; arg = strtok_r(NULL, " \t\r", &save)) {
+                syntax->filematch = editor_syntax_append(syntax->filematch, &nmatch, strdup(arg));
+            }
+        }
+        else if (!strcmp(directive, "keywords") || !strcmp(directive, "types")) {
+            for (; arg && error == NULL; arg = strtok_r(NULL, " \t\r", &save)) {
+                int klen = strlen(arg);
+                if (klen > HL_LOOKAHEAD || arg[klen - 1] == '|') {
+                    snprintf(message, sizeof(message), "keywords may not be longer than %d bytes or end in '|'", HL_LOOKAHEAD);
+                    error = message;
+                    break;
+                }
+                int listed = 0; // As a keyword or a type, the first one counts
+                for (int k = 0; k < nkeywords && !listed; k++) {
+                    char * w = syntax->keywords[k];
+                    listed   = !strncmp(w, arg, klen) && (w[klen] == '\0' || !strcmp(&w[klen], "|"));
+                }
+                if (listed) {
+                    continue;
+                }
+                char * word = malloc(klen + 2);
+                sprintf(word, "%s%s", arg, directive[0] == 't' ? "|" : "");
+                syntax->keywords = editor_syntax_append(syntax->keywords, &nkeywords, word);
+            }
+        }
+        else if (!strcmp(directive, "separators") && arg) {
+            free(syntax->separators);
+            syntax->separators = strdup(arg);
+        }
+        else if (!strcmp(directive, "numbers") && arg && (!strcmp(arg, "on") || !strcmp(arg, "off"))) {
+            syntax->flags = (arg[1] == 'n') ? syntax->flags | HL_HIGHLIGHT_NUMBERS : syntax->flags & ~HL_HIGHLIGHT_NUMBERS;
+        }
+        else if (!strcmp(directive, "region") && arg) {
+            char * end = strtok_r(NULL, " \t\r", &save);
+            char * hl  = strtok_r(NULL, " \t\r", &save);
+            struct hl_region * r = &syntax->regions[nregions];
+            if (nregions == HL_REGIONS_MAX) {
+                error = "too many regions";
+            }
+            else if (end == NULL || hl == NULL) {
+                error = "region needs the delimiters that open and close it and its highlight";
+            }
+            else if (strlen(arg) > HL_LOOKAHEAD || strlen(end) > HL_LOOKAHEAD) {
+                snprintf(message, sizeof(message), "delimiters may not be longer than %d bytes", HL_LOOKAHEAD);
+                error = message;
+            }
+            else {
+                r->start = strdup(arg);
+                r->end   = strcmp(end, "-") ? strdup(end) : NULL;
+                r->hl    = !strcmp(hl, "comment") ? HL_COMMENT : !strcmp(hl, "mlcomment") ? HL_MLCOMMENT :
+                  !strcmp(hl, "string") ? HL_STRING : HL_NORMAL;
+                nregions++;
+                if (r->hl == HL_NORMAL) {
+                    error = "region highlight must be comment, mlcomment or string";
+                }
+                for (char * flag; error == NULL && (flag = strtok_r(NULL, " \t\r", &save)); ) {
+                    if (!strcmp(flag, "escapes")) {
+                        r->flags |= HL_REGION_ESCAPES;
+                    }
+                    else if (!strcmp(flag, "multiline")) {
+                        r->flags |= HL_REGION_MULTILINE;
+                    }
+                    else if (!strcmp(flag, "after-sep")) {
+                        r->flags |= HL_REGION_AFTER_SEP;
+                    }
+                    else {
+                        error = "region flags are escapes, multiline and after-sep";
+                    }
+                }
+                if (error == NULL && r->end == NULL && (r->flags & HL_REGION_MULTILINE)) {
+                    error = "a region running to the end of the line can't be multiline";
+                }
+            }
+        }
+        else {
+            error = "unknown directive or missing argument";
+        }
+    }
+    if (error == NULL && (syntax->filetype == NULL || nmatch == 0)) {
+        error = "filetype and match are required";
+    }
+    for (int k = 0; error == NULL && k < nkeywords; k++) { // See editor_syntax_compile_keywords()
+        char * word = syntax->keywords[k];
+        int klen    = strlen(word) - (word[strlen(word) - 1] == '|');
+        for (int i = 0; i < klen; i++) {
+            unsigned char c = word[i];
+            if (editor_syntax_is_separator(syntax, c)) {
+                error = "keywords may not hold a separator";
+            }
+        }
+    }
+    if (error) {
+        editor_set_status_message("%s:%d: %s", name, lineno, error);
+        editor_syntax_free(syntax);
+        return -1;
+    }
+    return 0;
+} /* editor_syntax_parse */
+
+/**
+ * Appends s to the NULL terminated list holding n strings, returns the list
+ */
+char ** editor_syntax_append(char ** list, int * n, char * s) {
+    list = realloc(list, sizeof(char *) * (*n + 2));
+    list[(*n)++] = s;
+    list[*n]     = NULL;
+    return list;
+}
+
+/**
+ * Frees what a syntax read from a syntax file holds
+ */
+void editor_syntax_free(struct editor_syntax * syntax) {
+    for (char ** m = syntax->filematch; m && *m; m++) {
+        free(*m);
+    }
+    for (char ** k = syntax->keywords; k && *k; k++) {
+        free(*k);
+    }
+    for (struct hl_region * r = syntax->regions; r && r->start; r++) {
+        free(r->start);
+        free(r->end);
+    }
+    if (syntax->lexer) {
+        free(syntax->lexer->moves);
+        free(syntax->lexer->runs);
+        free(syntax->lexer->keyword_table);
+        free(syntax->lexer);
+    }
+    free(syntax->filetype);
+    free(syntax->filematch);
+    free(syntax->keywords);
+    free(syntax->regions);
+    free(syntax->separators);
+    free(syntax->cache);
+    memset(syntax, 0, sizeof(struct editor_syntax));
+}
+
+/**
+ * Reads the lexer of syntax from its cache. Returns -1 if there is none, it
+ * was compiled from another syntax file or by another build, or it holds
+ * moves or keywords the lexer could not have, a damaged cache say
+ */
+int editor_syntax_cache_read(struct editor_syntax * syntax) {
+    FILE * fp = fopen(syntax->cache, "rb");
+    if (fp == NULL) {
+        return -1;
+    }
+    struct hl_lexer * lexer = calloc(1, sizeof(struct hl_lexer));
+    struct hl_cache_header h;
+    int nkeywords = 0;
+    while (syntax->keywords[nkeywords]) {
+        nkeywords++;
+    }
+    editor_syntax_init_lexer(syntax, lexer);
+    int ok = fread(&h, sizeof(h), 1, fp) == 1 && !memcmp(h.magic, HL_CACHE_MAGIC, sizeof(h.magic)) &&
+      h.key == syntax->cache_key && h.nstates == lexer->nstates && h.nclasses > 0 && h.nclasses <= 256 &&
+      h.keyword_mask < HL_KEYWORD_SLOTS && (h.keyword_mask & (h.keyword_mask + 1)) == 0 &&
+      fread(lexer->classes, sizeof(lexer->classes), 1, fp) == 1;
+    if (ok) {
+        int nmoves = h.nstates * h.nclasses;
+        lexer->nclasses      = h.nclasses;
+        lexer->keyword_mask  = h.keyword_mask;
+        lexer->keyword_seed  = h.keyword_seed;
+        lexer->moves         = malloc(nmoves * sizeof(struct hl_move));
+        lexer->keyword_table = calloc(h.keyword_mask + 1, sizeof(struct hl_keyword));
+        ok = fread(lexer->moves, sizeof(struct hl_move), nmoves, fp) == (size_t)nmoves;
+        for (int c = 0; ok && c < 256; c++) {
+            ok = lexer->classes[c] < h.nclasses;
+        }
+        for (int m = 0; ok && m < nmoves; m++) {
+            int at  = m / h.nclasses;
+            int act = lexer->moves[m].act;
+            ok = lexer->moves[m].next < h.nstates && lexer->moves[m].hl <= HL_MATCH &&
+              !(act & ~(HL_ACT_OPEN | HL_ACT_CLOSE | HL_ACT_ESCAPE | HL_ACT_KEYWORD));
+            if (ok && at >= HL_DFA_REGION) { // Only regions close, and only those with an end
+                ok = !(act & (HL_ACT_OPEN | HL_ACT_KEYWORD)) &&
+                  (!(act & HL_ACT_CLOSE) || syntax->regions[at - HL_DFA_REGION].end);
+            }
+            else if (ok) {
+                ok = !(act & (HL_ACT_CLOSE | HL_ACT_ESCAPE));
+            }
+        }
+        for (unsigned int i = 0; ok && i <= h.keyword_mask; i++) {
+            int k; // Index of the keyword in slot i, -1 for none
+            ok = fread(&k, sizeof(k), 1, fp) == 1 && k >= -1 && k < nkeywords;
+            if (ok && k >= 0) {
+                editor_syntax_keyword_slot(&lexer->keyword_table[i], syntax->keywords[k]);
+            }
+        }
+        ok = ok && fgetc(fp) == EOF;
+    }
+    fclose(fp);
+    if (!ok) {
+        free(lexer->moves);
+        free(lexer->keyword_table);
+        free(lexer);
+        return -1;
+    }
+    syntax->lexer = lexer;
+    editor_syntax_compile_runs(lexer);
+    return 0;
+} /* editor_syntax_cache_read */
+
+/**
+ * Writes the lexer of syntax to its cache, making the directory it goes in
+ * if needed. A cache that can't be written is left out
+ */
+void editor_syntax_cache_write(struct editor_syntax * syntax) {
+    struct hl_lexer * lexer = syntax->lexer;
+    struct hl_cache_header h;
+    char * tmp = malloc(strlen(syntax->cache) + 8);
+    sprintf(tmp, "%s.XXXXXX", syntax->cache);
+
+    int fd = mkstemp(tmp);
+    if (fd == -1 && errno == ENOENT) { // Make each directory on the way, then try again
+        for (char * slash = strchr(tmp + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+            *slash = '\0';
+            mkdir(tmp, 0755);
+            *slash = '/';
+        }
+        sprintf(tmp, "%s.XXXXXX", syntax->cache);
+        fd = mkstemp(tmp);
+    }
+    FILE * fp = (fd == -1) ? NULL : fdopen(fd, "wb");
+    if (fp == NULL) {
+        if (fd != -1) {
+            close(fd);
+            unlink(tmp);
+        }
+        free(tmp);
+        return;
+    }
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, HL_CACHE_MAGIC, sizeof(h.magic));
+    h.key          = syntax->cache_key;
+    h.nstates      = lexer->nstates;
+    h.nclasses     = lexer->nclasses;
+    h.keyword_mask = lexer->keyword_mask;
+    h.keyword_seed = lexer->keyword_seed;
+    int ok = fwrite(&h, sizeof(h), 1, fp) == 1 && fwrite(lexer->classes, sizeof(lexer->classes), 1, fp) == 1 &&
+      fwrite(lexer->moves, sizeof(struct hl_move), lexer->nstates * lexer->nclasses, fp) ==
+      (size_t)(lexer->nstates * lexer->nclasses);
+    for (unsigned int i = 0; ok && i <= lexer->keyword_mask; i++) {
+        int k = -1;
+        if (lexer->keyword_table[i].word) {
+            for (k = 0; syntax->keywords[k] != lexer->keyword_table[i].word; k++) {
+            }
+        }
+        ok = fwrite(&k, sizeof(k), 1, fp) == 1;
+    }
+    if (fclose(fp) != 0 || !ok || rename(tmp, syntax->cache) == -1) {
+        unlink(tmp);
+    }
+    free(tmp);
+} /* editor_syntax_cache_write */
+
+/********************************
+* Background Highlighting
+********************************/
+
+/*
+ * A row is highlighted from the state the row before it ends in, so the
+ * first row shown after a jump far into a file used to wait for every row
+ * above it. When a syntax has regions spanning rows and the file is mapped,
+ * a worker thread instead walks the mapped file from the top as soon as it
+ * is opened, and records the state each line starts in. It only reads the
+ * mapping, which never changes while it is open, and E.syntax, which is
+ * only changed with the worker stopped, so it needs no other locking:
+ * states are published a batch of lines at a time by raising done under
+ * the lock.
+ *
+ * The states hold for the rows up to the first one edited, inserted or
+ * deleted since the file was opened, E.hl_worker.limit. A row whose start
+ * state is not known yet and is too far from a highlighted row is
+ * highlighted from a guess and flagged ROW_HL_GUESS, so the screen is
+ * drawn right away. editor_read_key() polls the worker while it waits for
+ * input, and rows on screen highlighted from a guess are highlighted again
+ * once their state comes in. Tabs are not expanded by the worker, which
+ * changes no state: a tab and the spaces it renders as are all separators.
+ */
+
+/**
+ * Starts the worker on the mapped file, if the syntax has regions that span
+ * rows
+ */
+void editor_hl_worker_start() {
+    struct editor_hl_worker * w = &E.hl_worker;
+
+    if (E.file.map == NULL || E.syntax == NULL || !E.syntax->lexer->multiline || E.pager || w->limit == 0) {
+        return;
+    }
+    w->states  = malloc(E.file.nlines);
+    w->done    = 0;
+    w->seen    = 0;
+    w->stop    = 0;
+    w->running = 1;
+    if (pthread_create(&w->thread, NULL, editor_hl_worker_thread, w) != 0) { // Rows are found the old way
+        free(w->states);
+        w->states  = NULL;
+        w->running = 0;
+    }
+}
+
+/**
+ * Stops the worker and drops the states it found
+ */
+void editor_hl_worker_stop() {
+    struct editor_hl_worker * w = &E.hl_worker;
+
+    if (w->running) {
+        pthread_mutex_lock(&w->lock);
+        w->stop = 1;
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->thread, NULL);
+        w->running = 0;
     }
-    int current = last_match;
-    for (int i = 0; i < E.numrows; i++) {
-        current += direction;
-        if (current == -1) {
-            current = E.numrows - 1;
-        }
-        else if (current == E.numrows) {
-            current = 0;
-        }
-        erow * row   = &E.editor_row[current];
-        char * match = strstr(row->render, query);
-        if (match) { // If a match is found, convert substring location into an index
-            last_match    = current;
-            E.cy          = current;
-            E.cx          = editor_row_rx_to_cx(row, match - row->render);
-            E.rowoff      = E.numrows;
-            saved_hl_line = current;
-            saved_hl      = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
+    free(w->states);
+    w->states = NULL;
+    w->done   = 0;
+    w->seen   = 0;
+}
+
+/**
+ * Thread body finding the state every line of the mapped file starts in
+ */
+void * editor_hl_worker_thread(void * arg) {
+    struct editor_hl_worker * w = arg;
+    int state = HL_DFA_SEP;
+    int len;
+    char * line = editor_file_line(0, &len);
+
+    for (int i = 0; i < E.file.nlines; ) {
+        int end = (E.file.nlines - i > HL_WORKER_BATCH) ? i + HL_WORKER_BATCH : E.file.nlines;
+        for (; i < end; i++) {
+            w->states[i] = state;
+            state = editor_syntax_carry(editor_syntax_scan(line, len, len, NULL, state));
+            if (i + 1 < E.file.nlines) {
+                line = editor_file_next_line(line, len, &len);
+            }
+        }
+        pthread_mutex_lock(&w->lock);
+        w->done  = i;
+        int stop = w->stop;
+        pthread_mutex_unlock(&w->lock);
+        if (stop) {
             break;
         }
     }
-} /* editor_find_callback */
+    return NULL;
+}
+
+/**
+ * Takes in the states the worker found since the last call, and reaps it
+ * once it is done. Returns whether rows on screen highlighted from a guess
+ * need to be drawn again
+ */
+int editor_hl_worker_poll() {
+    struct editor_hl_worker * w = &E.hl_worker;
+
+    if (w->states == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&w->lock);
+    int done = w->done;
+    pthread_mutex_unlock(&w->lock);
+    if (done == w->seen) {
+        return 0;
+    }
+    w->seen = done;
+    if (done == E.file.nlines && w->running) {
+        pthread_join(w->thread, NULL);
+        w->running = 0;
+    }
+    int redraw = 0;
+    for (int y = E.rowoff; y < E.rowoff + E.row && y < E.numrows; y++) {
+        erow * row = editor_row_at(y);
+        if (editor_hl_worker_guessed(row)) {
+            row->flags &= ~(ROW_HL_VALID | ROW_HL_ENDS);
+            redraw      = 1;
+        }
+    }
+    return redraw;
+}
+
+/**
+ * Returns the state the worker found row to start in, -1 if it has not got
+ * that far or can't tell
+ */
+int editor_hl_worker_state(erow * row) {
+    struct editor_hl_worker * w = &E.hl_worker;
+
+    if (w->states == NULL) {
+        return -1;
+    }
+    int at = editor_row_index(row);
+    pthread_mutex_lock(&w->lock);
+    int done = w->done;
+    pthread_mutex_unlock(&w->lock);
+    return (at <= w->limit && at < done) ? w->states[at] : -1;
+}
+
+/**
+ * Returns whether row was highlighted from a guess that can now be done
+ * better: the worker found its state, or never will
+ */
+int editor_hl_worker_guessed(erow * row) {
+    if (!(row->flags & ROW_HL_GUESS)) {
+        return 0;
+    }
+    if (!E.hl_worker.running) {
+        return 1;
+    }
+    return editor_hl_worker_state(row) >= 0 || editor_row_index(row) > E.hl_worker.limit;
+}
+
+/**
+ * Notes that the row at index at was edited, inserted or deleted, rows
+ * after it may no longer start like the lines of the mapped file do
+ */
+void editor_hl_worker_edited(int at) {
+    if (at < E.hl_worker.limit) {
+        E.hl_worker.limit = at;
+    }
+}
+
+/********************************
+* UTF-8
+********************************/
+
+/*
+ * Rows hold raw bytes and are rendered as UTF-8. A character takes 1 or 2
+ * columns after its East Asian width, combining marks take none, and bytes
+ * that do not decode are shown one per column so every byte stays visible.
+ * Most rows are plain ASCII and get through utf8_is_ascii() without any of it.
+ */
+
+/**
+ * Determines whether all len bytes at s are ASCII
+ */
+int utf8_is_ascii(const char * s, int len) {
+    int i = 0;
+
+#if defined(__AVX2__)
+    for ( ; i + 32 <= len; i += 32) {
+        if (_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)&s[i]))) {
+            return 0;
+        }
+    }
+#elif defined(__SSE2__)
+    for ( ; i + 16 <= len; i += 16) {
+        if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)&s[i]))) {
+            return 0;
+        }
+    }
+#endif
+    for ( ; i < len; i++) {
+        if ((unsigned char)s[i] >= 0x80) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Returns how many bytes the sequence started by lead claims to take
+ */
+int utf8_length(char lead) {
+    unsigned char c = lead;
+
+    if (c >= 0xc2 && c <= 0xdf) {
+        return 2;
+    }
+    if (c >= 0xe0 && c <= 0xef) {
+        return 3;
+    }
+    if (c >= 0xf0 && c <= 0xf4) {
+        return 4;
+    }
+    return 1;
+}
+
+/**
+ * Decodes the character at the start of the len bytes at s into cp and
+ * returns its length, or returns 1 and sets cp to UTF8_INVALID for a byte
+ * that does not start a well formed sequence
+ */
+int utf8_decode(const char * s, int len, unsigned int * cp) {
+    static const unsigned int min[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+    const unsigned char * u = (const unsigned char *)s;
+    int n = utf8_length(s[0]);
+
+    *cp = u[0];
+    if (u[0] < 0x80) {
+        return 1;
+    }
+    if (n == 1 || n > len) {
+        *cp = UTF8_INVALID;
+        return 1;
+    }
+    unsigned int c = u[0] & (0x7f >> n);
+    for (int i = 1; i < n; i++) {
+        if (!UTF8_CONT(u[i])) {
+            *cp = UTF8_INVALID;
+            return 1;
+        }
+        c = (c << 6) | (u[i] & 0x3f);
+    }
+    if (c < min[n] || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff)) { // Overlong or surrogate
+        *cp = UTF8_INVALID;
+        return 1;
+    }
+    *cp = c;
+    return n;
+}
+
+/**
+ * Returns how many columns a character takes on screen. The table holds the
+ * code points that are not 1 column wide, generated from the Unicode 14.0
+ * data: East Asian Width W and F, which takes in the emoji shown as such,
+ * and the free code points of the CJK ideograph blocks are 2 columns,
+ * nonspacing and enclosing marks, format characters, and the Hangul vowels
+ * and finals that join the leading consonant are 0
+ */
+int utf8_width(unsigned int cp) {
+    static const unsigned int ranges[][3] = { // First, last, width
+        { 0x0300,  0x036f,  0 }, { 0x0483,  0x0489,  0 }, { 0x0591,  0x05bd,  0 },
+        { 0x05bf,  0x05bf,  0 }, { 0x05c1,  0x05c2,  0 }, { 0x05c4,  0x05c5,  0 },
+        { 0x05c7,  0x05c7,  0 }, { 0x0600,  0x0605,  0 }, { 0x0610,  0x061a,  0 },
+        { 0x061c,  0x061c,  0 }, { 0x064b,  0x065f,  0 }, { 0x0670,  0x0670,  0 },
+        { 0x06d6,  0x06dd,  0 }, { 0x06df,  0x06e4,  0 }, { 0x06e7,  0x06e8,  0 },
+        { 0x06ea,  0x06ed,  0 }, { 0x070f,  0x070f,  0 }, { 0x0711,  0x0711,  0 },
+        { 0x0730,  0x074a,  0 }, { 0x07a6,  0x07b0,  0 }, { 0x07eb,  0x07f3,  0 },
+        { 0x07fd,  0x07fd,  0 }, { 0x0816,  0x0819,  0 }, { 0x081b,  0x0823,  0 },
+        { 0x0825,  0x0827,  0 }, { 0x0829,  0x082d,  0 }, { 0x0859,  0x085b,  0 },
+        { 0x0890,  0x0891,  0 }, { 0x0898,  0x089f,  0 }, { 0x08ca,  0x0902,  0 },
+        { 0x093a,  0x093a,  0 }, { 0x093c,  0x093c,  0 }, { 0x0941,  0x0948,  0 },
+        { 0x094d,  0x094d,  0 }, { 0x0951,  0x0957,  0 }, { 0x0962,  0x0963,  0 },
+        { 0x0981,  0x0981,  0 }, { 0x09bc,  0x09bc,  0 }, { 0x09c1,  0x09c4,  0 },
+        { 0x09cd,  0x09cd,  0 }, { 0x09e2,  0x09e3,  0 }, { 0x09fe,  0x09fe,  0 },
+        { 0x0a01,  0x0a02,  0 }, { 0x0a3c,  0x0a3c,  0 }, { 0x0a41,  0x0a42,  0 },
+        { 0x0a47,  0x0a48,  0 }, { 0x0a4b,  0x0a4d,  0 }, { 0x0a51,  0x0a51,  0 },
+        { 0x0a70,  0x0a71,  0 }, { 0x0a75,  0x0a75,  0 }, { 0x0a81,  0x0a82,  0 },
+        { 0x0abc,  0x0abc,  0 }, { 0x0ac1,  0x0ac5,  0 }, { 0x0ac7,  0x0ac8,  0 },
+        { 0x0acd,  0x0acd,  0 }, { 0x0ae2,  0x0ae3,  0 }, { 0x0afa,  0x0aff,  0 },
+        { 0x0b01,  0x0b01,  0 }, { 0x0b3c,  0x0b3c,  0 }, { 0x0b3f,  0x0b3f,  0 },
+        { 0x0b41,  0x0b44,  0 }, { 0x0b4d,  0x0b4d,  0 }, { 0x0b55,  0x0b56,  0 },
+        { 0x0b62,  0x0b63,  0 }, { 0x0b82,  0x0b82,  0 }, { 0x0bc0,  0x0bc0,  0 },
+        { 0x0bcd,  0x0bcd,  0 }, { 0x0c00,  0x0c00,  0 }, { 0x0c04,  0x0c04,  0 },
+        { 0x0c3c,  0x0c3c,  0 }, { 0x0c3e,  0x0c40,  0 }, { 0x0c46,  0x0c48,  0 },
+        { 0x0c4a,  0x0c4d,  0 }, { 0x0c55,  0x0c56,  0 }, { 0x0c62,  0x0c63,  0 },
+        { 0x0c81,  0x0c81,  0 }, { 0x0cbc,  0x0cbc,  0 }, { 0x0cbf,  0x0cbf,  0 },
+        { 0x0cc6,  0x0cc6,  0 }, { 0x0ccc,  0x0ccd,  0 }, { 0x0ce2,  0x0ce3,  0 },
+        { 0x0d00,  0x0d01,  0 }, { 0x0d3b,  0x0d3c,  0 }, { 0x0d41,  0x0d44,  0 },
+        { 0x0d4d,  0x0d4d,  0 }, { 0x0d62,  0x0d63,  0 }, { 0x0d81,  0x0d81,  0 },
+        { 0x0dca,  0x0dca,  0 }, { 0x0dd2,  0x0dd4,  0 }, { 0x0dd6,  0x0dd6,  0 },
+        { 0x0e31,  0x0e31,  0 }, { 0x0e34,  0x0e3a,  0 }, { 0x0e47,  0x0e4e,  0 },
+        { 0x0eb1,  0x0eb1,  0 }, { 0x0eb4,  0x0ebc,  0 }, { 0x0ec8,  0x0ecd,  0 },
+        { 0x0f18,  0x0f19,  0 }, { 0x0f35,  0x0f35,  0 }, { 0x0f37,  0x0f37,  0 },
+        { 0x0f39,  0x0f39,  0 }, { 0x0f71,  0x0f7e,  0 }, { 0x0f80,  0x0f84,  0 },
+        { 0x0f86,  0x0f87,  0 }, { 0x0f8d,  0x0f97,  0 }, { 0x0f99,  0x0fbc,  0 },
+        { 0x0fc6,  0x0fc6,  0 }, { 0x102d,  0x1030,  0 }, { 0x1032,  0x1037,  0 },
+        { 0x1039,  0x103a,  0 }, { 0x103d,  0x103e,  0 }, { 0x1058,  0x1059,  0 },
+        { 0x105e,  0x1060,  0 }, { 0x1071,  0x1074,  0 }, { 0x1082,  0x1082,  0 },
+        { 0x1085,  0x1086,  0 }, { 0x108d,  0x108d,  0 }, { 0x109d,  0x109d,  0 },
+        { 0x1100,  0x115f,  2 }, { 0x1160,  0x11ff,  0 }, { 0x135d,  0x135f,  0 },
+        { 0x1712,  0x1714,  0 }, { 0x1732,  0x1733,  0 }, { 0x1752,  0x1753,  0 },
+        { 0x1772,  0x1773,  0 }, { 0x17b4,  0x17b5,  0 }, { 0x17b7,  0x17bd,  0 },
+        { 0x17c6,  0x17c6,  0 }, { 0x17c9,  0x17d3,  0 }, { 0x17dd,  0x17dd,  0 },
+        { 0x180b,  0x180f,  0 }, { 0x1885,  0x1886,  0 }, { 0x18a9,  0x18a9,  0 },
+        { 0x1920,  0x1922,  0 }, { 0x1927,  0x1928,  0 }, { 0x1932,  0x1932,  0 },
+        { 0x1939,  0x193b,  0 }, { 0x1a17,  0x1a18,  0 }, { 0x1a1b,  0x1a1b,  0 },
+        { 0x1a56,  0x1a56,  0 }, { 0x1a58,  0x1a5e,  0 }, { 0x1a60,  0x1a60,  0 },
+        { 0x1a62,  0x1a62,  0 }, { 0x1a65,  0x1a6c,  0 }, { 0x1a73,  0x1a7c,  0 },
+        { 0x1a7f,  0x1a7f,  0 }, { 0x1ab0,  0x1ace,  0 }, { 0x1b00,  0x1b03,  0 },
+        { 0x1b34,  0x1b34,  0 }, { 0x1b36,  0x1b3a,  0 }, { 0x1b3c,  0x1b3c,  0 },
+        { 0x1b42,  0x1b42,  0 }, { 0x1b6b,  0x1b73,  0 }, { 0x1b80,  0x1b81,  0 },
+        { 0x1ba2,  0x1ba5,  0 }, { 0x1ba8,  0x1ba9,  0 }, { 0x1bab,  0x1bad,  0 },
+        { 0x1be6,  0x1be6,  0 }, { 0x1be8,  0x1be9,  0 }, { 0x1bed,  0x1bed,  0 },
+        { 0x1bef,  0x1bf1,  0 }, { 0x1c2c,  0x1c33,  0 }, { 0x1c36,  0x1c37,  0 },
+        { 0x1cd0,  0x1cd2,  0 }, { 0x1cd4,  0x1ce0,  0 }, { 0x1ce2,  0x1ce8,  0 },
+        { 0x1ced,  0x1ced,  0 }, { 0x1cf4,  0x1cf4,  0 }, { 0x1cf8,  0x1cf9,  0 },
+        { 0x1dc0,  0x1dff,  0 }, { 0x200b,  0x200f,  0 }, { 0x202a,  0x202e,  0 },
+        { 0x2060,  0x2064,  0 }, { 0x2066,  0x206f,  0 }, { 0x20d0,  0x20f0,  0 },
+        { 0x231a,  0x231b,  2 }, { 0x2329,  0x232a,  2 }, { 0x23e9,  0x23ec,  2 },
+        { 0x23f0,  0x23f0,  2 }, { 0x23f3,  0x23f3,  2 }, { 0x25fd,  0x25fe,  2 },
+        { 0x2614,  0x2615,  2 }, { 0x2648,  0x2653,  2 }, { 0x267f,  0x267f,  2 },
+        { 0x2693,  0x2693,  2 }, { 0x26a1,  0x26a1,  2 }, { 0x26aa,  0x26ab,  2 },
+        { 0x26bd,  0x26be,  2 }, { 0x26c4,  0x26c5,  2 }, { 0x26ce,  0x26ce,  2 },
+        { 0x26d4,  0x26d4,  2 }, { 0x26ea,  0x26ea,  2 }, { 0x26f2,  0x26f3,  2 },
+        { 0x26f5,  0x26f5,  2 }, { 0x26fa,  0x26fa,  2 }, { 0x26fd,  0x26fd,  2 },
+        { 0x2705,  0x2705,  2 }, { 0x270a,  0x270b,  2 }, { 0x2728,  0x2728,  2 },
+        { 0x274c,  0x274c,  2 }, { 0x274e,  0x274e,  2 }, { 0x2753,  0x2755,  2 },
+        { 0x2757,  0x2757,  2 }, { 0x2795,  0x2797,  2 }, { 0x27b0,  0x27b0,  2 },
+        { 0x27bf,  0x27bf,  2 }, { 0x2b1b,  0x2b1c,  2 }, { 0x2b50,  0x2b50,  2 },
+        { 0x2b55,  0x2b55,  2 }, { 0x2cef,  0x2cf1,  0 }, { 0x2d7f,  0x2d7f,  0 },
+        { 0x2de0,  0x2dff,  0 }, { 0x2e80,  0x2e99,  2 }, { 0x2e9b,  0x2ef3,  2 },
+        { 0x2f00,  0x2fd5,  2 }, { 0x2ff0,  0x2ffb,  2 }, { 0x3000,  0x3029,  2 },
+        { 0x302a,  0x302d,  0 }, { 0x302e,  0x303e,  2 }, { 0x3041,  0x3096,  2 },
+        { 0x3099,  0x309a,  0 }, { 0x309b,  0x30ff,  2 }, { 0x3105,  0x312f,  2 },
+        { 0x3131,  0x318e,  2 }, { 0x3190,  0x31e3,  2 }, { 0x31f0,  0x321e,  2 },
+        { 0x3220,  0x3247,  2 }, { 0x3250,  0x4dbf,  2 }, { 0x4e00,  0xa48c,  2 },
+        { 0xa490,  0xa4c6,  2 }, { 0xa66f,  0xa672,  0 }, { 0xa674,  0xa67d,  0 },
+        { 0xa69e,  0xa69f,  0 }, { 0xa6f0,  0xa6f1,  0 }, { 0xa802,  0xa802,  0 },
+        { 0xa806,  0xa806,  0 }, { 0xa80b,  0xa80b,  0 }, { 0xa825,  0xa826,  0 },
+        { 0xa82c,  0xa82c,  0 }, { 0xa8c4,  0xa8c5,  0 }, { 0xa8e0,  0xa8f1,  0 },
+        { 0xa8ff,  0xa8ff,  0 }, { 0xa926,  0xa92d,  0 }, { 0xa947,  0xa951,  0 },
+        { 0xa960,  0xa97c,  2 }, { 0xa980,  0xa982,  0 }, { 0xa9b3,  0xa9b3,  0 },
+        { 0xa9b6,  0xa9b9,  0 }, { 0xa9bc,  0xa9bd,  0 }, { 0xa9e5,  0xa9e5,  0 },
+        { 0xaa29,  0xaa2e,  0 }, { 0xaa31,  0xaa32,  0 }, { 0xaa35,  0xaa36,  0 },
+        { 0xaa43,  0xaa43,  0 }, { 0xaa4c,  0xaa4c,  0 }, { 0xaa7c,  0xaa7c,  0 },
+        { 0xaab0,  0xaab0,  0 }, { 0xaab2,  0xaab4,  0 }, { 0xaab7,  0xaab8,  0 },
+        { 0xaabe,  0xaabf,  0 }, { 0xaac1,  0xaac1,  0 }, { 0xaaec,  0xaaed,  0 },
+        { 0xaaf6,  0xaaf6,  0 }, { 0xabe5,  0xabe5,  0 }, { 0xabe8,  0xabe8,  0 },
+        { 0xabed,  0xabed,  0 }, { 0xac00,  0xd7a3,  2 }, { 0xd7b0,  0xd7ff,  0 },
+        { 0xf900,  0xfaff,  2 }, { 0xfb1e,  0xfb1e,  0 }, { 0xfe00,  0xfe0f,  0 },
+        { 0xfe10,  0xfe19,  2 }, { 0xfe20,  0xfe2f,  0 }, { 0xfe30,  0xfe52,  2 },
+        { 0xfe54,  0xfe66,  2 }, { 0xfe68,  0xfe6b,  2 }, { 0xfeff,  0xfeff,  0 },
+        { 0xff01,  0xff60,  2 }, { 0xffe0,  0xffe6,  2 }, { 0xfff9,  0xfffb,  0 },
+        { 0x101fd, 0x101fd, 0 }, { 0x102e0, 0x102e0, 0 }, { 0x10376, 0x1037a, 0 },
+        { 0x10a01, 0x10a03, 0 }, { 0x10a05, 0x10a06, 0 }, { 0x10a0c, 0x10a0f, 0 },
+        { 0x10a38, 0x10a3a, 0 }, { 0x10a3f, 0x10a3f, 0 }, { 0x10ae5, 0x10ae6, 0 },
+        { 0x10d24, 0x10d27, 0 }, { 0x10eab, 0x10eac, 0 }, { 0x10f46, 0x10f50, 0 },
+        { 0x10f82, 0x10f85, 0 }, { 0x11001, 0x11001, 0 }, { 0x11038, 0x11046, 0 },
+        { 0x11070, 0x11070, 0 }, { 0x11073, 0x11074, 0 }, { 0x1107f, 0x11081, 0 },
+        { 0x110b3, 0x110b6, 0 }, { 0x110b9, 0x110ba, 0 }, { 0x110bd, 0x110bd, 0 },
+        { 0x110c2, 0x110c2, 0 }, { 0x110cd, 0x110cd, 0 }, { 0x11100, 0x11102, 0 },
+        { 0x11127, 0x1112b, 0 }, { 0x1112d, 0x11134, 0 }, { 0x11173, 0x11173, 0 },
+        { 0x11180, 0x11181, 0 }, { 0x111b6, 0x111be, 0 }, { 0x111c9, 0x111cc, 0 },
+        { 0x111cf, 0x111cf, 0 }, { 0x1122f, 0x11231, 0 }, { 0x11234, 0x11234, 0 },
+        { 0x11236, 0x11237, 0 }, { 0x1123e, 0x1123e, 0 }, { 0x112df, 0x112df, 0 },
+        { 0x112e3, 0x112ea, 0 }, { 0x11300, 0x11301, 0 }, { 0x1133b, 0x1133c, 0 },
+        { 0x11340, 0x11340, 0 }, { 0x11366, 0x1136c, 0 }, { 0x11370, 0x11374, 0 },
+        { 0x11438, 0x1143f, 0 }, { 0x11442, 0x11444, 0 }, { 0x11446, 0x11446, 0 },
+        { 0x1145e, 0x1145e, 0 }, { 0x114b3, 0x114b8, 0 }, { 0x114ba, 0x114ba, 0 },
+        { 0x114bf, 0x114c0, 0 }, { 0x114c2, 0x114c3, 0 }, { 0x115b2, 0x115b5, 0 },
+        { 0x115bc, 0x115bd, 0 }, { 0x115bf, 0x115c0, 0 }, { 0x115dc, 0x115dd, 0 },
+        { 0x11633, 0x1163a, 0 }, { 0x1163d, 0x1163d, 0 }, { 0x1163f, 0x11640, 0 },
+        { 0x116ab, 0x116ab, 0 }, { 0x116ad, 0x116ad, 0 }, { 0x116b0, 0x116b5, 0 },
+        { 0x116b7, 0x116b7, 0 }, { 0x1171d, 0x1171f, 0 }, { 0x11722, 0x11725, 0 },
+        { 0x11727, 0x1172b, 0 }, { 0x1182f, 0x11837, 0 }, { 0x11839, 0x1183a, 0 },
+        { 0x1193b, 0x1193c, 0 }, { 0x1193e, 0x1193e, 0 }, { 0x11943, 0x11943, 0 },
+        { 0x119d4, 0x119d7, 0 }, { 0x119da, 0x119db, 0 }, { 0x119e0, 0x119e0, 0 },
+        { 0x11a01, 0x11a0a, 0 }, { 0x11a33, 0x11a38, 0 }, { 0x11a3b, 0x11a3e, 0 },
+        { 0x11a47, 0x11a47, 0 }, { 0x11a51, 0x11a56, 0 }, { 0x11a59, 0x11a5b, 0 },
+        { 0x11a8a, 0x11a96, 0 }, { 0x11a98, 0x11a99, 0 }, { 0x11c30, 0x11c36, 0 },
+        { 0x11c38, 0x11c3d, 0 }, { 0x11c3f, 0x11c3f, 0 }, { 0x11c92, 0x11ca7, 0 },
+        { 0x11caa, 0x11cb0, 0 }, { 0x11cb2, 0x11cb3, 0 }, { 0x11cb5, 0x11cb6, 0 },
+        { 0x11d31, 0x11d36, 0 }, { 0x11d3a, 0x11d3a, 0 }, { 0x11d3c, 0x11d3d, 0 },
+        { 0x11d3f, 0x11d45, 0 }, { 0x11d47, 0x11d47, 0 }, { 0x11d90, 0x11d91, 0 },
+        { 0x11d95, 0x11d95, 0 }, { 0x11d97, 0x11d97, 0 }, { 0x11ef3, 0x11ef4, 0 },
+        { 0x13430, 0x13438, 0 }, { 0x16af0, 0x16af4, 0 }, { 0x16b30, 0x16b36, 0 },
+        { 0x16f4f, 0x16f4f, 0 }, { 0x16f8f, 0x16f92, 0 }, { 0x16fe0, 0x16fe3, 2 },
+        { 0x16fe4, 0x16fe4, 0 }, { 0x16ff0, 0x16ff1, 2 }, { 0x17000, 0x187f7, 2 },
+        { 0x18800, 0x18cd5, 2 }, { 0x18d00, 0x18d08, 2 }, { 0x1aff0, 0x1aff3, 2 },
+        { 0x1aff5, 0x1affb, 2 }, { 0x1affd, 0x1affe, 2 }, { 0x1b000, 0x1b122, 2 },
+        { 0x1b150, 0x1b152, 2 }, { 0x1b164, 0x1b167, 2 }, { 0x1b170, 0x1b2fb, 2 },
+        { 0x1bc9d, 0x1bc9e, 0 }, { 0x1bca0, 0x1bca3, 0 }, { 0x1cf00, 0x1cf2d, 0 },
+        { 0x1cf30, 0x1cf46, 0 }, { 0x1d167, 0x1d169, 0 }, { 0x1d173, 0x1d182, 0 },
+        { 0x1d185, 0x1d18b, 0 }, { 0x1d1aa, 0x1d1ad, 0 }, { 0x1d242, 0x1d244, 0 },
+        { 0x1da00, 0x1da36, 0 }, { 0x1da3b, 0x1da6c, 0 }, { 0x1da75, 0x1da75, 0 },
+        { 0x1da84, 0x1da84, 0 }, { 0x1da9b, 0x1da9f, 0 }, { 0x1daa1, 0x1daaf, 0 },
+        { 0x1e000, 0x1e006, 0 }, { 0x1e008, 0x1e018, 0 }, { 0x1e01b, 0x1e021, 0 },
+        { 0x1e023, 0x1e024, 0 }, { 0x1e026, 0x1e02a, 0 }, { 0x1e130, 0x1e136, 0 },
+        { 0x1e2ae, 0x1e2ae, 0 }, { 0x1e2ec, 0x1e2ef, 0 }, { 0x1e8d0, 0x1e8d6, 0 },
+        { 0x1e944, 0x1e94a, 0 }, { 0x1f004, 0x1f004, 2 }, { 0x1f0cf, 0x1f0cf, 2 },
+        { 0x1f18e, 0x1f18e, 2 }, { 0x1f191, 0x1f19a, 2 }, { 0x1f200, 0x1f202, 2 },
+        { 0x1f210, 0x1f23b, 2 }, { 0x1f240, 0x1f248, 2 }, { 0x1f250, 0x1f251, 2 },
+        { 0x1f260, 0x1f265, 2 }, { 0x1f300, 0x1f320, 2 }, { 0x1f32d, 0x1f335, 2 },
+        { 0x1f337, 0x1f37c, 2 }, { 0x1f37e, 0x1f393, 2 }, { 0x1f3a0, 0x1f3ca, 2 },
+        { 0x1f3cf, 0x1f3d3, 2 }, { 0x1f3e0, 0x1f3f0, 2 }, { 0x1f3f4, 0x1f3f4, 2 },
+        { 0x1f3f8, 0x1f43e, 2 }, { 0x1f440, 0x1f440, 2 }, { 0x1f442, 0x1f4fc, 2 },
+        { 0x1f4ff, 0x1f53d, 2 }, { 0x1f54b, 0x1f54e, 2 }, { 0x1f550, 0x1f567, 2 },
+        { 0x1f57a, 0x1f57a, 2 }, { 0x1f595, 0x1f596, 2 }, { 0x1f5a4, 0x1f5a4, 2 },
+        { 0x1f5fb, 0x1f64f, 2 }, { 0x1f680, 0x1f6c5, 2 }, { 0x1f6cc, 0x1f6cc, 2 },
+        { 0x1f6d0, 0x1f6d2, 2 }, { 0x1f6d5, 0x1f6d7, 2 }, { 0x1f6dd, 0x1f6df, 2 },
+        { 0x1f6eb, 0x1f6ec, 2 }, { 0x1f6f4, 0x1f6fc, 2 }, { 0x1f7e0, 0x1f7eb, 2 },
+        { 0x1f7f0, 0x1f7f0, 2 }, { 0x1f90c, 0x1f93a, 2 }, { 0x1f93c, 0x1f945, 2 },
+        { 0x1f947, 0x1f9ff, 2 }, { 0x1fa70, 0x1fa74, 2 }, { 0x1fa78, 0x1fa7c, 2 },
+        { 0x1fa80, 0x1fa86, 2 }, { 0x1fa90, 0x1faac, 2 }, { 0x1fab0, 0x1faba, 2 },
+        { 0x1fac0, 0x1fac5, 2 }, { 0x1fad0, 0x1fad9, 2 }, { 0x1fae0, 0x1fae7, 2 },
+        { 0x1faf0, 0x1faf6, 2 }, { 0x20000, 0x2fffd, 2 }, { 0x30000, 0x3fffd, 2 },
+        { 0xe0001, 0xe0001, 0 }, { 0xe0020, 0xe007f, 0 }, { 0xe0100, 0xe01ef, 0 },
+    };
+    int lo = 0;
+    int hi = sizeof(ranges) / sizeof(ranges[0]);
+
+    if (cp < 0x300 || cp == UTF8_INVALID) {
+        return 1;
+    }
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (ranges[mid][1] < cp) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    if (lo < (int)(sizeof(ranges) / sizeof(ranges[0])) && ranges[lo][0] <= cp) {
+        return ranges[lo][2];
+    }
+    return 1;
+}
 
 /********************************
-* Syntax Highlighting
+* File I/O
 ********************************/
 
+/*
+ * Regular files are mapped read-only instead of read line by line. Opening
+ * only records where every TEDITOR_INDEX_STRIDE-th line starts and links in
+ * a single span for the whole file; lines are located from the nearest
+ * index entry when they are first shown, and copied into the heap only when
+ * edited. The untouched text stays in the page cache.
+ */
+
 /**
- * Goes through the characters of an erow and highlights them if needed
+ * Maps the file read-only and indexes its lines,
+ * returns -1 if the file can't be mapped
  */
-void editor_update_syntax(erow * row) {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
-    if (E.syntax == NULL) {
-        return;
+int editor_map_file(int fd) {
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return -1;
     }
-    char ** keywords = E.syntax->keywords;
-    char * scs       = E.syntax->singleline_comment_start;
-    char * mcs       = E.syntax->multiline_comment_start;
-    char * mce       = E.syntax->multiline_comment_end;
-    int scs_len      = scs ? strlen(scs) : 0;
-    int mcs_len      = mcs ? strlen(mcs) : 0;
-    int mce_len      = mce ? strlen(mce) : 0;
-    int prev_sep     = 1;
-    int in_string    = 0;
-    int in_comment   = (row->idx > 0 && E.editor_row[row->idx - 1].hl_open_comment);
-    int i = 0;
-    while (i < row->rsize) {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
-        if (scs_len && !in_string && !in_comment) { // Single line comments
-            if (!strncmp(&row->render[i], scs, scs_len)) {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-                break;
-            }
-        }
-        if (mcs_len && mce_len && !in_string) { // Multiline comments
-            if (in_comment) {
-                row->hl[i] = HL_MLCOMMENT;
-                if (!strncmp(&row->render[i], mce, mce_len)) {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-                    i += mce_len;
-                    in_comment = 0;
-                    prev_sep   = 1;
-                    continue;
-                }
-                else {
-                    i++;
-                    continue;
-                }
-            }
-            else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-                i += mcs_len;
-                in_comment = 1;
-                continue;
-            }
-        }
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-            if (in_string) {
-                row->hl[i] = HL_STRING;
-                if (c == '\\' && i + 1 < row->rsize) {
-                    row->hl[i + 1] = HL_STRING;
-                    i += 2;
-                    continue;
-                }
-                if (c == in_string) {
-                    in_string = 0;
-                }
-                i++;
-                prev_sep = 1;
-                continue;
-            }
-            else {
-                if (c == '"' || c == '\'') {
-                    in_string  = c;
-                    row->hl[i] = HL_STRING;
-                    i++;
-                    continue;
-                }
+    char * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    E.file.map  = map;
+    E.file.size = st.st_size;
+    editor_index_lines(0);
+    return 0;
+}
+
+/*
+ * Indexing splits the file into TEDITOR_INDEX_CHUNK sized slices scanned by
+ * one thread each, looking at NEWLINE_SCAN_WIDTH bytes at a time with
+ * SSE2/AVX2 compares where available. A first pass only counts newlines per
+ * chunk, so every chunk then knows the number of its first line, and a
+ * second pass has each chunk write its own, disjoint, entries of the index.
+ * \r\n needs no special care: the line still ends at the \n, and the \r is
+ * trimmed when the line is measured.
+ */
+
+/**
+ * Counts the lines of the mapped file and records where every
+ * TEDITOR_INDEX_STRIDE-th one starts, nthreads of 0 picks one thread per CPU
+ */
+void editor_index_lines(int nthreads) {
+    struct index_chunk chunks[TEDITOR_INDEX_THREADS];
+
+    if (nthreads <= 0) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (nthreads > (int)(E.file.size / TEDITOR_INDEX_CHUNK) + 1) {
+        nthreads = E.file.size / TEDITOR_INDEX_CHUNK + 1;
+    }
+    if (nthreads > TEDITOR_INDEX_THREADS) {
+        nthreads = TEDITOR_INDEX_THREADS;
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    size_t step = E.file.size / nthreads;
+    for (int i = 0; i < nthreads; i++) {
+        chunks[i].start  = &E.file.map[step * i];
+        chunks[i].end    = (i == nthreads - 1) ? &E.file.map[E.file.size] : &E.file.map[step * (i + 1)];
+        chunks[i].before = 0;
+        chunks[i].record = 0;
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 1; i < nthreads; i++) {
+            if (pthread_create(&chunks[i].thread, NULL, editor_index_chunk, &chunks[i]) != 0) {
+                editor_index_chunk(&chunks[i]);
+                chunks[i].thread = pthread_self();
             }
         }
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-            if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-              (c == '.' && prev_hl == HL_NUMBER))
-            {
-                row->hl[i] = HL_NUMBER;
-                i++;
-                prev_sep = 0;
-                continue;
+        editor_index_chunk(&chunks[0]);
+        for (int i = 1; i < nthreads; i++) {
+            if (!pthread_equal(chunks[i].thread, pthread_self())) {
+                pthread_join(chunks[i].thread, NULL);
             }
         }
-        if (prev_sep) {
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int kw2  = keywords[j][klen - 1] == '|';
-                if (kw2) {
-                    klen--;
-                }
-                if (!strncmp(&row->render[i], keywords[j], klen) && is_separator(row->render[i + klen])) {
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
-                    break;
-                }
-            }
-            if (keywords[j] != NULL) {
-                prev_sep = 0;
-                continue;
+        if (pass == 0) {
+            int newlines = 0;
+            for (int i = 0; i < nthreads; i++) {
+                chunks[i].before = newlines;
+                chunks[i].record = 1;
+                newlines        += chunks[i].count;
             }
+            E.file.nlines = newlines + (E.file.map[E.file.size - 1] != '\n');
+            E.file.index  = malloc(sizeof(size_t) * (E.file.nlines / TEDITOR_INDEX_STRIDE + 1));
+            E.file.index[0] = 0;
         }
-        prev_sep = is_separator(c);
-        i++;
     }
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < E.numrows) {
-        editor_update_syntax(&E.editor_row[row->idx + 1]);
+}
+
+/**
+ * Returns a bit mask of the newlines among the NEWLINE_SCAN_WIDTH bytes at p
+ */
+unsigned int newline_mask(const char * p) {
+#if defined(__AVX2__)
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+#elif defined(__SSE2__)
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+#else
+    unsigned int mask = 0;
+    for (int i = 0; i < NEWLINE_SCAN_WIDTH; i++) {
+        mask |= (unsigned int)(p[i] == '\n') << i;
     }
-} /* editor_update_syntax */
+    return mask;
+#endif
+}
 
 /**
- * Matches the current filename to one of the filematch fields,
- * if a match is found, sets E.syntax to that filetype
+ * Thread body scanning one chunk: counts its newlines, or on the second
+ * pass stores the start of every TEDITOR_INDEX_STRIDE-th line in the index
  */
-void editor_select_syntax_highlight() {
-    E.syntax = NULL;
-    if (E.filename == NULL) {
-        return;
+void * editor_index_chunk(void * arg) {
+    struct index_chunk * chunk = arg;
+    const char * p = chunk->start;
+    int line       = chunk->before; // Newlines seen so far, the number of the line at p
+    int until      = TEDITOR_INDEX_STRIDE - line % TEDITOR_INDEX_STRIDE; // Newlines left until the next indexed line
+
+    for ( ; p + NEWLINE_SCAN_WIDTH <= chunk->end; p += NEWLINE_SCAN_WIDTH) {
+        unsigned int mask = newline_mask(p);
+        int n = __builtin_popcount(mask);
+        if (chunk->record && n >= until) {
+            while (mask) {
+                const char * nl = p + __builtin_ctz(mask);
+                mask &= mask - 1;
+                line++;
+                if (--until == 0) {
+                    if (nl + 1 < &E.file.map[E.file.size]) {
+                        E.file.index[line / TEDITOR_INDEX_STRIDE] = nl + 1 - E.file.map;
+                    }
+                    until = TEDITOR_INDEX_STRIDE;
+                }
+            }
+        }
+        else {
+            line  += n;
+            until -= n;
+        }
     }
-    char * ext = strrchr(E.filename, '.');
-    for (unsigned int i = 0; i < HLDB_ENTRIES; i++) {
-        struct editor_syntax * s = &HLDB[i];
-        unsigned int j = 0;
-        while (s->filematch[j]) {
-            int is_ext = (s->filematch[j][0] == '.');
-            if ((is_ext && ext && !strcmp(ext, s->filematch[j])) ||
-              (!is_ext && strstr(E.filename, s->filematch[j])))
-            {
-                E.syntax = s;
-                for (int filerow = 0; filerow < E.numrows; filerow++) {
-                    editor_update_syntax(&E.editor_row[filerow]);
+    for ( ; p < chunk->end; p++) {
+        if (*p == '\n') {
+            line++;
+            if (chunk->record && --until == 0) {
+                if (p + 1 < &E.file.map[E.file.size]) {
+                    E.file.index[line / TEDITOR_INDEX_STRIDE] = p + 1 - E.file.map;
                 }
-                return;
+                until = TEDITOR_INDEX_STRIDE;
             }
-            j++;
         }
     }
+    chunk->count = line - chunk->before;
+    return NULL;
 }
 
 /**
- * Maps values in hl to the actual ANSI color codes that characters should
- * be drawn in
+ * Returns the start of a line of the mapped file and its length
  */
-int editor_syntax_to_color(int hl) {
-    switch (hl) {
-        case HL_COMMENT:
-        case HL_MLCOMMENT:
-            return 36;
+char * editor_file_line(int line, int * len) {
+    char * start = &E.file.map[E.file.index[line / TEDITOR_INDEX_STRIDE]];
 
-        case HL_KEYWORD1:
-            return 33;
-
-        case HL_KEYWORD2:
-            return 32;
+    for (int i = line % TEDITOR_INDEX_STRIDE; i > 0; i--) {
+        start = (char *)memchr(start, '\n', &E.file.map[E.file.size] - start) + 1;
+    }
+    return editor_file_line_len(start, len);
+}
 
-        case HL_STRING:
-            return 35;
+/**
+ * Measures the line starting at start, without its line terminator
+ */
+char * editor_file_line_len(char * start, int * len) {
+    char * end = memchr(start, '\n', &E.file.map[E.file.size] - start);
 
-        case HL_NUMBER:
-            return 31;
+    if (end == NULL) {
+        end = &E.file.map[E.file.size];
+    }
+    while (end > start && (end[-1] == '\r' || end[-1] == '\n')) {
+        end--;
+    }
+    *len = end - start;
+    return start;
+}
 
-        case HL_MATCH:
-            return 34;
+/**
+ * Returns the offset of a line of the mapped file, or the size of the file
+ * for the line past the last one
+ */
+size_t editor_file_offset(int line) {
+    int len;
 
-        default:
-            return 37;
+    if (line >= E.file.nlines) {
+        return E.file.size;
     }
+    return editor_file_line(line, &len) - E.file.map;
 }
 
 /**
- * Determines whether character is a separator character
+ * Returns the line of the mapped file holding byte pos, a binary search of
+ * the index narrows it down to TEDITOR_INDEX_STRIDE lines
  */
-int is_separator(int c) {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*~%<>[];", c) != NULL;
+int editor_file_line_of(size_t pos) {
+    int lo = 0;
+    int hi = (E.file.nlines - 1) / TEDITOR_INDEX_STRIDE;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (E.file.index[mid] <= pos) {
+            lo = mid;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+    int line    = lo * TEDITOR_INDEX_STRIDE;
+    char * p    = &E.file.map[E.file.index[lo]];
+    char * stop = &E.file.map[pos];
+    char * nl;
+    while (line < E.file.nlines - 1 && (nl = memchr(p, '\n', stop - p)) != NULL) {
+        p = nl + 1;
+        line++;
+    }
+    return line;
 }
 
-/********************************
-* File I/O
-********************************/
+/**
+ * Returns the start of the line following line, and its length
+ */
+char * editor_file_next_line(char * line, int len, int * next_len) {
+    char * nl = memchr(&line[len], '\n', &E.file.map[E.file.size] - &line[len]);
+
+    return editor_file_line_len(nl + 1, next_len);
+}
 
 /**
  * Attempts to open given filename for viewing
  */
 void editor_open(char * filename) {
+    editor_close_buffer();
     free(E.filename);
     E.filename = strdup(filename);
 
     editor_select_syntax_highlight();
 
-    FILE * fp = fopen(filename, "r");
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        unix_error("open");
+    }
+    if (editor_map_file(fd) == 0) {
+        close(fd);
+        if ((long long)E.file.size > TEDITOR_PAGER_THRESHOLD) {
+            E.pager = 1;
+        }
+        erow * span = editor_new_span(0, E.file.nlines);
+        row_tree_append(&span, 1);
+        E.dirty = 0;
+        E.hl_worker.limit = E.file.nlines;
+        editor_hl_worker_start();
+        return;
+    }
 
+    FILE * fp = fdopen(fd, "r"); // Pipes, devices and empty files are read as before
     if (!fp) {
-        unix_error("fopen");
+        unix_error("fdopen");
     }
     char * line    = NULL;
     size_t linecap = 0;
     ssize_t linelen;
+    erow ** rows   = NULL;
+    int nrows      = 0;
+    int rowcap     = 0;
     while ((linelen = getline(&line, &linecap, fp)) != -1) {
         while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
             linelen--;
         }
-        editor_insert_row(E.numrows, line, linelen);
+        if (nrows == rowcap) {
+            rowcap = rowcap ? rowcap * 2 : 1024;
+            rows   = realloc(rows, sizeof(erow *) * rowcap);
+        }
+        rows[nrows++] = editor_new_row(line, linelen);
     }
     free(line);
     fclose(fp);
+
+    row_tree_append(rows, nrows); // Rendered lazily, see editor_prepare_row()
+    free(rows);
     E.dirty = 0;
 }
 
+/*
+ * Saving never builds the file in memory. On the main thread, a snapshot of
+ * the buffer is taken as a list of pieces: rows point at their own gap
+ * buffers, and spans of untouched lines point at the mapped file. A save
+ * thread then hands the pieces to writev() SAVE_IOV_BATCH at a time while
+ * editing goes on. Rows in the snapshot are shared copy-on-write: the first
+ * edit of such a row gives it a fresh copy of its chars, and the old buffer
+ * is only freed once the save is done. The text goes to a temporary file next
+ * to the target, which is synced and then renamed over it, so a crash
+ * mid-save leaves either the old or the new file behind.
+ */
+
+/**
+ * Adds len bytes at p to the snapshot being taken
+ */
+void save_push(const char * p, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    if (E.save.iovcnt == E.save.iovcap) {
+        E.save.iovcap = E.save.iovcap ? E.save.iovcap * 2 : SAVE_IOV_BATCH;
+        E.save.iov    = realloc(E.save.iov, sizeof(struct iovec) * E.save.iovcap);
+    }
+    E.save.iov[E.save.iovcnt].iov_base = (void *)p;
+    E.save.iov[E.save.iovcnt].iov_len  = len;
+    E.save.iovcnt++;
+    E.save.total += len;
+}
+
+/**
+ * Writes out iovcnt pieces, coping with short writes, returns 0 or an errno
+ */
+int save_writev(int fd, struct iovec * iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base  = (char *)iov->iov_base + n;
+            iov->iov_len  -= n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Snapshots the whole buffer, one line per row followed by a newline, and
+ * marks the rows as shared with the save
+ */
+void editor_save_rows() {
+    int len;
+
+    for (erow * t = row_tree_first(); t; t = row_tree_next(t)) {
+        if (!(t->flags & ROW_SPAN)) {
+            save_push(t->chars, t->gap_start);
+            save_push(&t->chars[t->gap_start + t->gap_len], t->size - t->gap_start);
+            save_push("\n", 1);
+            if (!(t->flags & ROW_MAPPED)) { // The mapping never changes, no need to share
+                t->save_gen = E.save.gen;
+            }
+            continue;
+        }
+        char * first = editor_file_line(t->span_first, &len);
+        char * last  = (t->lines == 1) ? first : editor_file_line(t->span_first + t->lines - 1, &len);
+        char * end   = memchr(&last[len], '\n', &E.file.map[E.file.size] - &last[len]);
+        if (memchr(first, '\r', (end ? end : &last[len]) - first) == NULL) {
+            // Already in the form we write out, the span goes out in one piece
+            save_push(first, (end ? end + 1 : &last[len]) - first);
+            if (end == NULL) {
+                save_push("\n", 1);
+            }
+            continue;
+        }
+        char * line = editor_file_line_len(first, &len);
+        for (int i = 0; i < t->lines; i++) {
+            save_push(line, len);
+            save_push("\n", 1);
+            if (i + 1 < t->lines) {
+                line = editor_file_next_line(line, len, &len);
+            }
+        }
+    }
+}
+
+/**
+ * Returns whether a row's chars are still referenced by a running save
+ */
+int editor_row_shared(erow * row) {
+    return E.save.active && row->save_gen == E.save.gen;
+}
+
+/**
+ * Hands a chars buffer taken away from a shared row to the save, which frees
+ * it once it is done
+ */
+void editor_save_defer(char * p, size_t size) {
+    if (E.save.ndeferred == E.save.deferredcap) {
+        E.save.deferredcap = E.save.deferredcap ? E.save.deferredcap * 2 : 64;
+        E.save.deferred    = realloc(E.save.deferred, sizeof(struct save_block) * E.save.deferredcap);
+    }
+    E.save.deferred[E.save.ndeferred].p    = p;
+    E.save.deferred[E.save.ndeferred].size = size;
+    E.save.ndeferred++;
+}
+
+/**
+ * Snapshots the buffer and starts writing it to filename on the save thread,
+ * returns -1 and leaves errno set if the save can't be started
+ */
+int editor_save_start(const char * filename) {
+    char * target = realpath(filename, NULL); // Write through symlinks
+    if (target == NULL) {
+        target = strdup(filename);
+    }
+    char * slash = strrchr(target, '/');
+    int dirlen   = slash ? slash - target + 1 : 0;
+    char * tmp   = malloc(strlen(target) + 32);
+    snprintf(tmp, strlen(target) + 32, "%.*s.%s.teditor-XXXXXX", dirlen, target, slash ? slash + 1 : target);
+
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        free(tmp);
+        free(target);
+        return -1;
+    }
+    struct stat st;
+    if (stat(target, &st) == 0) {
+        fchmod(fd, st.st_mode & 07777);
+    }
+    else {
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0644 & ~mask);
+    }
+
+    E.save.fd       = fd;
+    E.save.tmp      = tmp;
+    E.save.target   = target;
+    E.save.dirlen   = dirlen;
+    E.save.iovcnt   = 0;
+    E.save.total    = 0;
+    E.save.written  = 0;
+    E.save.error    = 0;
+    E.save.finished = 0;
+    E.save.dirty    = E.dirty;
+    E.save.gen++;
+    editor_save_rows();
+    E.save.active = 1;
+    if (pthread_create(&E.save.thread, NULL, editor_save_thread, &E.save) != 0) {
+        editor_save_thread(&E.save);
+        E.save.thread = pthread_self();
+    }
+    return 0;
+}
+
 /**
- * Converts array of erow structs into a single string ready to
- * be written out to a file
+ * Save thread body: writes the snapshot, syncs it and renames it into place
  */
-char * editor_rows_to_string(int * buflen) {
-    int totlen = 0;
+void * editor_save_thread(void * arg) {
+    struct editor_save * s = arg;
+    int error = 0;
+
+    for (int i = 0; i < s->iovcnt && !error; i += SAVE_IOV_BATCH) {
+        int n = (s->iovcnt - i < SAVE_IOV_BATCH) ? s->iovcnt - i : SAVE_IOV_BATCH;
+        long long bytes = 0;
+        for (int j = i; j < i + n; j++) {
+            bytes += s->iov[j].iov_len;
+        }
+        error = save_writev(s->fd, &s->iov[i], n);
+        pthread_mutex_lock(&s->lock);
+        s->written += bytes;
+        pthread_mutex_unlock(&s->lock);
+    }
+    if (!error && fsync(s->fd) == -1) {
+        error = errno;
+    }
+    if (close(s->fd) == -1 && !error) {
+        error = errno;
+    }
+    if (!error && rename(s->tmp, s->target) == -1) {
+        error = errno;
+    }
+    if (error) {
+        unlink(s->tmp);
+    }
+    else {
+        s->tmp[s->dirlen] = '\0'; // Sync the directory too, making the rename itself durable
+        int dirfd = open(s->dirlen ? s->tmp : ".", O_RDONLY);
+        if (dirfd != -1) {
+            fsync(dirfd);
+            close(dirfd);
+        }
+    }
+    pthread_mutex_lock(&s->lock);
+    s->error    = error;
+    s->finished = 1;
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
 
-    for (int i = 0; i < E.numrows; i++) {
-        totlen += E.editor_row[i].size + 1;
+/**
+ * Reports the progress of a running save in the status bar, and wraps it up
+ * once the save thread is done. Returns whether a save is still running
+ */
+int editor_save_poll() {
+    if (!E.save.active) {
+        return 0;
     }
-    *buflen = totlen;
+    pthread_mutex_lock(&E.save.lock);
+    int finished       = E.save.finished;
+    long long written  = E.save.written;
+    pthread_mutex_unlock(&E.save.lock);
+    if (!finished) {
+        editor_set_status_message("Saving... %lld%%", E.save.total ? written * 100 / E.save.total : 100);
+        return 1;
+    }
+    if (!pthread_equal(E.save.thread, pthread_self())) {
+        pthread_join(E.save.thread, NULL);
+    }
+    E.save.active = 0;
+    for (int i = 0; i < E.save.ndeferred; i++) {
+        pool_free(E.save.deferred[i].p, E.save.deferred[i].size);
+    }
+    E.save.ndeferred = 0;
+    free(E.save.tmp);
+    free(E.save.target);
+    if (E.save.error) {
+        editor_set_status_message("Can't save! I/O error: %s", strerror(E.save.error));
+        return 0;
+    }
+    E.dirty -= E.save.dirty; // Only what was in the snapshot is on disk
+    editor_set_status_message("%lld bytes written to disk", E.save.total);
+    return 0;
+}
 
-    char * buf = malloc(totlen);
-    char * p   = buf;
-    for (int i = 0; i < E.numrows; i++) {
-        memcpy(p, E.editor_row[i].chars, E.editor_row[i].size);
-        p += E.editor_row[i].size;
-        *p = '\n';
-        p++;
+/**
+ * Blocks until a running save is done
+ */
+void editor_save_wait() {
+    while (editor_save_poll()) {
+        usleep(10000);
     }
-    return buf;
 }
 
 /**
@@ -1021,6 +5476,10 @@ char * editor_rows_to_string(int * buflen) {
  * Windows, 'esc' will have to be pressed 3 times)
  */
 void editor_save() {
+    if (E.save.active) {
+        editor_set_status_message("A save is already in progress");
+        return;
+    }
     if (E.filename == NULL) {
         E.filename = editor_prompt("Save as: %s (ESC to cancel)", NULL);
         if (E.filename == NULL) {
@@ -1029,23 +5488,11 @@ void editor_save() {
         }
         editor_select_syntax_highlight();
     }
-    int len;
-    char * buf = editor_rows_to_string(&len);
-    int fd     = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editor_set_status_message("%d bytes written to disk", len);
-                return;
-            }
-        }
-        close(fd);
+    if (editor_save_start(E.filename) == -1) {
+        editor_set_status_message("Can't save! I/O error: %s", strerror(errno));
+        return;
     }
-    free(buf);
-    editor_set_status_message("Can't save! I/O error: %s", strerror(errno));
+    editor_save_poll();
 }
 
 /********************************
@@ -1059,24 +5506,33 @@ int editor_read_key() {
     int nread;
     char c;
 
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+    while ((nread = editor_read_byte(&c)) != 1) {
         if ((nread == -1) && (errno != EAGAIN)) {
             unix_error("read");
         }
+        int guessed = editor_hl_worker_poll(); // Rows on screen highlighted from a guess can be done right
+        guessed    |= editor_syntax_finish(1);
+        if (E.save.active) { // Keep the save progress on screen up to date
+            editor_save_poll();
+            editor_refresh_screen();
+        }
+        else if (E.resized || guessed) {
+            editor_refresh_screen();
+        }
     }
 
     if (c == '\x1b') { // Char is a form of an escape sequence
         char seq[3];
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) {
+        if (editor_read_byte(&seq[0]) != 1) {
             return '\x1b';
         }
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) {
+        if (editor_read_byte(&seq[1]) != 1) {
             return '\x1b';
         }
 
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) {
+                if (editor_read_byte(&seq[2]) != 1) {
                     return '\x1b';
                 }
                 if (seq[2] == '~') {
@@ -1140,6 +5596,45 @@ int editor_read_key() {
     return c;
 } /* editor_read_key */
 
+/**
+ * Reads one byte of input, from what an earlier read() brought in when
+ * possible, returns what read() does otherwise
+ */
+int editor_read_byte(char * c) {
+    if (E.input.pos == E.input.len) {
+        int nread = read(STDIN_FILENO, E.input.buf, sizeof(E.input.buf));
+        if (nread <= 0) {
+            return nread;
+        }
+        E.input.len = nread;
+        E.input.pos = 0;
+    }
+    *c = E.input.buf[E.input.pos++];
+    return 1;
+}
+
+/**
+ * Waits up to ms milliseconds for input, returns whether there is some
+ */
+int editor_input_wait(long ms) {
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+
+    if (E.input.pos < E.input.len) {
+        return 1;
+    }
+    return poll(&pfd, 1, ms) > 0;
+}
+
+/**
+ * Returns a monotonic timestamp in milliseconds
+ */
+long editor_now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 /**
  * Turns off ECHO feature, this means that input is no longer
  * printed to the console
@@ -1191,6 +5686,26 @@ int get_window_size(int * rows, int * cols) {
     return 0;
 }
 
+/**
+ * Handles SIGWINCH by only noting it, see editor_handle_resize()
+ */
+void editor_sigwinch(int sig) {
+    (void)sig;
+    E.resized = 1;
+}
+
+/**
+ * Takes on the new size of the terminal, the screen is drawn from scratch
+ * and soft wrapped rows get laid out again for the new width as they show up
+ */
+void editor_handle_resize() {
+    E.resized = 0;
+    if (get_window_size(&E.row, &E.col) == -1) {
+        unix_error("get_window_size");
+    }
+    E.row -= 2;
+}
+
 /**
  * Gets the position of the cursor for purposes of finding the
  * terminal window size, used if 'ioctl' fails
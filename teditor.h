@@ -1,3 +1,7 @@
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -8,53 +12,298 @@
 #include <termios.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define NEWLINE_SCAN_WIDTH 32
+#define RUN_SCAN_WIDTH     32
+#elif defined(__SSE2__)
+#include <immintrin.h>
+#define NEWLINE_SCAN_WIDTH 16
+#define RUN_SCAN_WIDTH     16
+#else
+#define NEWLINE_SCAN_WIDTH 8
+#define RUN_SCAN_WIDTH     8
+#endif
 
 /********************************
 * Data
 ********************************/
 
+struct row_chunk {
+    int len;              // Bytes of the row in the chunk
+    int pre;              // Columns before the first tab, or all of them if there is none
+    int rest;             // Columns from the tab stop after the first tab on, -1 without a tab
+    int state;            // Highlighter state at the start of the chunk, -1 if unknown
+    int start;            // Chars index and display column the chunk starts at,
+    int col;              // only up to date for the first known chunks
+};
+
+struct row_chunks {
+    struct row_chunk * c;
+    int n;
+    int cap;
+    int known;            // Chunks from the first on whose start and col are up to date
+    int tab_stop;         // E.tab_stop the columns were measured with
+    struct editor_syntax * syntax; // E.syntax the states were found with
+    int hl_first;         // First and last chunk edited since the states were last
+    int hl_last;          // brought up to date, hl_last is -1 if none was
+    int anchor;           // Chars index the render window is kept around
+};
+
 typedef struct erow {
-    int idx;
+    struct erow * left;   // Row tree links, see "Row Tree" in teditor.c
+    struct erow * right;
+    struct erow * parent;
+    unsigned int prio;
+    int count;            // Number of lines in the subtree rooted here
+    int lines;            // Lines this node stands for, only spans have more than one
+    size_t count_bytes;   // Number of bytes in the subtree rooted here
+    size_t bytes;         // Bytes this node stands for, see row_tree_bytes()
+    int span_first;       // First line of a span, or the line a mapped row came from
+    unsigned int save_gen; // Chars are shared with the save of this generation
     int size;
     int rsize;
-    char * chars;
+    char * chars;         // Gap buffer, see editor_row_chars() for a flat view
+    int gap_start;        // Index of the first byte of the gap in chars
+    int gap_len;          // Length of the gap, chars holds size + gap_len + 1 bytes
     char * render;
     unsigned char * hl;
-    int hl_open_comment;
+    int * tabs;           // Chars index of each tab and render index right after it
+    int ntabs;
+    int * colmap;         // Display column of each render byte, NULL if render is all ASCII
+    int * wraps;          // Render index each visual row starts at, NULL if render is all ASCII
+    int nwraps;           // Visual rows of the row in soft wrap mode
+    int wrap_cols;        // Screen width wraps was made for, 0 once render changes
+    struct row_chunks * chunks; // Layout of a long row, NULL for the rest, see "Long Rows"
+    int win_start;        // Chars render starts at, 0 unless the row is long
+    int win_end;          // Chars render ends at, size unless the row is long
+    int win_col;          // Display column of win_start
+    int tab_stop;         // E.tab_stop render was built with
+    int hl_end_state;     // Highlighter state the next row starts in, see editor_syntax_carry()
+    int flags;            // ROW_SPAN, ROW_MAPPED, ROW_RENDER_VALID and ROW_HL_VALID
 } erow;
 
+#define POOL_CLASSES 9 // Size classes of 16 << 0 through 16 << 8 bytes
+
+struct pool_slab {
+    struct pool_slab * next;
+};
+
+struct row_pool {
+    struct pool_slab * slabs;         // Every slab, released together in pool_release()
+    char * next[POOL_CLASSES];        // Bump pointer into the current slab of each class
+    char * end[POOL_CLASSES];
+    void * free_list[POOL_CLASSES];   // Blocks returned by pool_free()
+    long saved;                       // Allocations served without a call to malloc
+};
+
+struct editor_file {
+    char * map;           // Read-only mapping of the opened file, or NULL
+    size_t size;
+    size_t * index;       // Offset of every TEDITOR_INDEX_STRIDE-th line
+    int nlines;
+};
+
+struct index_chunk {
+    const char * start;   // Slice of the mapped file scanned by one thread
+    const char * end;
+    int before;           // Newlines in all earlier chunks
+    int count;            // Newlines in this chunk
+    int record;           // Whether to fill in E.file.index on this pass
+    pthread_t thread;
+};
+
+#define SAVE_IOV_BATCH 512 // iovecs handed to one writev(), well under IOV_MAX
+
+struct save_block {
+    char * p;
+    size_t size;
+};
+
+struct editor_save {
+    pthread_t thread;
+    pthread_mutex_t lock; // Guards written, error and finished
+    int active;           // A save is running or waiting to be reaped by editor_save_poll()
+    int finished;
+    int error;            // errno of the first failure, 0 if none
+    unsigned int gen;     // Bumped for every save, see erow.save_gen
+    int dirty;            // E.dirty when the snapshot was taken
+    struct iovec * iov;   // The snapshot, pieces of rows and of the mapped file
+    int iovcnt;
+    int iovcap;
+    long long total;
+    long long written;
+    struct save_block * deferred; // Buffers taken away from shared rows, freed when done
+    int ndeferred;
+    int deferredcap;
+    char * target;
+    char * tmp;
+    int dirlen;
+    int fd;
+};
+
+struct editor_hl_worker {
+    pthread_t thread;
+    pthread_mutex_t lock; // Guards done and stop
+    int running;          // The thread is running or waiting to be joined
+    int stop;             // Asks the thread to give up
+    int done;             // Lines of the mapped file whose start state is in states
+    int seen;             // done when editor_hl_worker_poll() last looked
+    unsigned char * states; // State each line of the mapped file starts in, NULL if none are found
+    int limit;            // Rows up to this one still start like the lines of the mapped file do
+};
+
+struct abuf {
+    char * b;
+    int len;
+    int cap;
+};
+
+#define CELL_INVERSE 0x80 // Attribute bit of cells drawn in reverse video
+#define CELL_UTF8    0x40 // Attribute bit of cells holding a multibyte character
+#define CELL_CONT    0x20 // Attribute bit of the right half of a wide character
+#define CELL_STYLE   (~(CELL_UTF8 | CELL_CONT) & 0xff)
+#define CELL_ATTRS   256  // Every possible cell attribute
+
+struct screen_frame {
+    char * ch;            // rows * cols characters
+    unsigned char * attr; // Their attributes, editor_highlight classes possibly with CELL_ bits
+    unsigned int * seq;   // UTF-8 bytes of CELL_UTF8 cells, in memory order
+};
+
+struct editor_screen {
+    struct screen_frame front; // What the terminal shows
+    struct screen_frame back;  // The frame being drawn
+    int rows;
+    int cols;
+    int valid;            // Whether front really is on the terminal
+    int rowoff;           // E.rowoff the front frame was drawn at
+    int wrapoff;          // And E.wrapoff
+    struct abuf out;      // Frame output, kept from one refresh to the next
+    char sgr[2][CELL_ATTRS][16]; // Escapes switching to an attribute, see screen_sgr_init()
+    unsigned char sgr_len[2][CELL_ATTRS];
+    int frame_bytes;      // Bytes written by the last refresh
+    long long frames;
+    long long total_bytes;
+};
+
+#define INPUT_BUF_SIZE 4096
+
+struct editor_input {
+    char buf[INPUT_BUF_SIZE]; // Bytes read from the terminal but not consumed yet
+    int len;
+    int pos;
+};
+
 struct editor_config {
     int cx, cy;
     int rx;
     int rowoff;
     int coloff;
+    int wrap;             // Soft wrap mode, see "Soft Wrap" in teditor.c
+    int wrapoff;          // Visual rows of line rowoff above the screen, soft wrap only
+    int wrap_y;           // Screen line of the cursor, soft wrap only
     int row;
     int col;
     int numrows;
-    erow * editor_row;
+    erow * editor_row; // Root of the row tree
     int dirty;
     char * filename;
     char statusmsg[80];
     time_t statusmsg_time;
     struct editor_syntax * syntax;
+    struct editor_syntax * syntaxes; // Read from syntax files, see "Syntax Files"
+    int nsyntaxes;
+    struct row_pool pool;
+    struct editor_file file;
+    struct editor_save save;
+    int pager;            // Paging mode, see "Pager" in teditor.c
+    int mapped_rows;      // Rows whose chars still point into the mapped file
+    erow * hl_stale;      // No row above is flagged ROW_HL_STALE, NULL if none is
+    int hl_stale_rows;    // Rows flagged ROW_HL_STALE
+    erow * hl_long;       // Long row whose states past the window are still to find, see editor_syntax_finish()
+    struct editor_hl_worker hl_worker; // See "Background Highlighting"
+    struct editor_screen screen;
+    struct editor_input input;
+    int frame_ms;         // Shortest time between two redraws, 0 for no cap
+    int tab_stop;
+    volatile sig_atomic_t resized; // Set on SIGWINCH, the next refresh picks up the new size
     struct termios original_term;
 };
 
-struct abuf {
-    char * b;
-    int len;
+struct hl_keyword {
+    const char * word;    // NULL for an empty slot
+    int len;              // Without the trailing '|' of a HL_KEYWORD2
+    int hl;
+};
+
+#define HL_REGIONS_MAX 16 // Regions a syntax may define
+#define HL_RUN_RANGES  4  // Byte ranges a run of a lexer state is found with
+
+struct hl_region {
+    char * start;         // Delimiter opening the region, NULL ends the list
+    char * end;           // Delimiter closing it, NULL for one that runs to the end of the line
+    int hl;
+    int flags;            // HL_REGION_ESCAPES, HL_REGION_MULTILINE and HL_REGION_AFTER_SEP
+};
+
+struct hl_move {
+    unsigned char next;   // State the byte leads to
+    unsigned char hl;     // Highlight of the byte
+    unsigned char act;    // HL_ACT_* checks to make before taking the move, 0 for none
+};
+
+struct hl_run {
+    unsigned char lo[HL_RUN_RANGES][RUN_SCAN_WIDTH]; // Bytes from lo to lo + span keep the state as is,
+    unsigned char span[HL_RUN_RANGES][RUN_SCAN_WIDTH]; // repeated to fill a vector
+    int nranges;          // 0 for a state with no runs worth skipping
+    unsigned char hl;     // Highlight of the bytes of a run
+};
+
+struct hl_lexer {
+    unsigned char classes[256];   // Class of each byte, bytes every state treats alike share one
+    unsigned char separator[256]; // Whether each byte ends a word
+    struct hl_move * moves;       // moves[state * nclasses + class]
+    struct hl_run * runs;         // runs[state], see editor_syntax_compile_runs()
+    int nclasses;
+    int nstates;
+    int start_len[HL_REGIONS_MAX];
+    int end_len[HL_REGIONS_MAX];
+    int multiline;        // Some region spans rows
+    struct hl_keyword * keyword_table; // keywords by hash, see editor_syntax_compile()
+    unsigned int keyword_mask; // Slots in keyword_table, minus one
+    unsigned int keyword_seed;
+    int keyword_max;      // Length of the longest keyword
+};
+
+struct hl_cache_header {
+    char magic[8];
+    unsigned int key;     // editor_syntax.cache_key of the syntax it was compiled from
+    int nstates;
+    int nclasses;         // Followed by the classes, then the moves of the lexer
+    unsigned int keyword_mask; // Then the index of the keyword in each slot, -1 for none
+    unsigned int keyword_seed;
 };
 
 struct editor_syntax {
     char * filetype;
     char ** filematch;
     char ** keywords;
-    char * singleline_comment_start;
-    char * multiline_comment_start;
-    char * multiline_comment_end;
+    struct hl_region * regions; // Comments and strings, tried in order
+    char * separators;    // Separators besides whitespace, NULL for the default ones
     int flags;
+    struct hl_lexer * lexer; // Filled in by editor_syntax_lexer()
+    char * cache;         // File the lexer is cached in, NULL for a built-in syntax
+    unsigned int cache_key; // Hash of the syntax file the cache must have been compiled from
 };
 
 enum editor_key {
@@ -93,6 +342,8 @@ void init_editor(void);
 
 void editor_move_cursor(int key);
 void editor_process_keypress(void);
+void editor_process_input(void);
+void editor_set_tab_stop(void);
 char * editor_prompt(char * prompt, void (*callback)(char *, int));
 
 /********************************
@@ -100,32 +351,136 @@ char * editor_prompt(char * prompt, void (*callback)(char *, int));
 ********************************/
 
 void editor_refresh_screen(void);
-void editor_draw_rows(struct abuf * ab);
+void editor_draw_rows(void);
+void editor_draw_row(int y, erow * row, int b, int x);
 void editor_scroll();
-void editor_draw_status_bar(struct abuf * ab);
+void editor_draw_status_bar(void);
 void editor_set_status_message(const char * fmt, ...);
-void editor_draw_message_bar(struct abuf * ab);
+void editor_draw_message_bar(void);
+
+/********************************
+* Screen
+********************************/
+
+void screen_resize(int rows, int cols);
+void screen_put(int y, int x, const char * s, int len, unsigned char attr);
+void screen_put_utf8(int y, int x, const char * s, int len, int width, unsigned char attr);
+int screen_same(int at);
+void screen_sgr_init(void);
+void screen_sgr(struct abuf * ab, int from, int to);
+unsigned int screen_run_mask(const char * c, const unsigned char * hl, unsigned char h);
+int screen_run(const char * c, const unsigned char * hl, int len);
+void screen_scroll(struct abuf * ab, int rows, int delta);
+void screen_flush(struct abuf * ab);
 
 /********************************
 * Append Buffer
 ********************************/
 
+int ab_reserve(struct abuf * ab, int len);
 void ab_append(struct abuf * ab, const char * s, int len);
+void ab_putc(struct abuf * ab, char c);
+void ab_reset(struct abuf * ab);
 void ab_free(struct abuf * ab);
 
+/********************************
+* Row Pool
+********************************/
+
+int pool_class(size_t size);
+void * pool_alloc(size_t size);
+void pool_free(void * p, size_t size);
+void * pool_realloc(void * p, size_t old_size, size_t size);
+void pool_release(void);
+
+/********************************
+* Row Tree
+********************************/
+
+erow * editor_row_at(int at);
+int editor_row_index(erow * row);
+erow * editor_row_next(erow * row);
+erow * editor_row_prev(erow * row);
+erow * row_tree_first(void);
+erow * row_tree_next(erow * t);
+erow * row_tree_prev(erow * t);
+erow * row_tree_find(int at, int * offset);
+void row_tree_isolate(int at);
+unsigned int row_tree_rand(void);
+int row_tree_count(erow * t);
+size_t row_tree_count_bytes(erow * t);
+size_t row_tree_bytes(erow * t);
+void row_tree_resize(erow * t);
+erow * row_tree_find_offset(size_t off, int * at, size_t * offset);
+void row_tree_update(erow * t);
+erow * row_tree_merge(erow * a, erow * b);
+void row_tree_split(erow * t, int k, erow ** a, erow ** b);
+void row_tree_heapify(erow * t);
+erow * row_tree_build(erow ** rows, int lo, int hi);
+void row_tree_link(erow * node, int at);
+void row_tree_insert(erow * row, int at);
+erow * row_tree_unlink(int at, int lines);
+erow * row_tree_remove(int at);
+void row_tree_append(erow ** rows, int n);
+
 /********************************
 * Row Operations
 ********************************/
 
+erow * editor_new_row(char * s, size_t len);
+erow * editor_new_span(int first, int lines);
+void editor_span_to_row(erow * t);
+void editor_row_own(erow * row);
 void editor_insert_row(int at, char * s, size_t len);
+char * editor_row_chars(erow * row);
+void editor_row_move_gap(erow * row, int at);
+void editor_row_reserve(erow * row, int len);
+void editor_row_truncate(erow * row, int at);
 void editor_update_row(erow * row);
+int editor_row_decode(erow * row, int at, unsigned int * cp);
+int editor_row_next_char(erow * row, int cx);
+int editor_row_prev_char(erow * row, int cx);
+void editor_free_render(erow * row);
+void editor_invalidate_row(erow * row);
+int editor_row_rendered(erow * row);
+void editor_prepare_row(erow * row);
 int editor_row_cx_to_rx(erow * row, int cx);
 int editor_row_rx_to_cx(erow * row, int rx);
+int editor_row_cx_to_rbyte(erow * row, int cx);
+int editor_row_rbyte_to_cx(erow * row, int rbyte);
+int editor_row_rbyte_to_rx(erow * row, int rbyte);
+int editor_row_rx_to_rbyte(erow * row, int rx);
 void editor_row_insert_char(erow * row, int at, int c);
 void editor_row_del_char(erow * row, int at);
 void editor_free_row(erow * row);
 void editor_del_row(int at);
+void editor_close_buffer(void);
 void editor_row_append_string(erow * row, char * s, size_t len);
+int editor_row_find(erow * row, const char * query);
+
+/********************************
+* Long Rows
+********************************/
+
+void editor_chunks_build(erow * row);
+void editor_free_chunks(erow * row);
+void editor_chunk_measure(erow * row, struct row_chunk * c, int start);
+int editor_chunk_advance(struct row_chunk * c, int col);
+void editor_chunk_locate(erow * row, int k);
+int editor_chunk_find(erow * row, int at);
+int editor_chunk_find_col(erow * row, int rx);
+void editor_chunk_split(erow * row, int k);
+void editor_row_chunk_edit(erow * row, int at, int delta);
+void editor_row_window(erow * row);
+int editor_row_width(erow * row);
+int editor_chunks_highlight(erow * row, int state, int stop);
+
+/********************************
+* Pager
+********************************/
+
+void editor_pager_evict(void);
+void editor_pager_merge(void);
 
 /********************************
 * Editor Operations
@@ -141,22 +496,116 @@ void editor_insert_newline();
 
 void editor_find();
 void editor_find_callback(char * query, int key);
+void editor_find_mark(erow * row, int cx, int len, erow ** saved_row, char ** saved, int * saved_len);
+int editor_find_raw(char * query, int from, int direction, int * cx);
+
+/********************************
+* Goto
+********************************/
+
+void editor_goto_line(void);
+void editor_goto_offset(void);
+int editor_offset_to_line(size_t off, int * cx);
+void editor_jump(int at, int cx, int center);
+
+/********************************
+* Soft Wrap
+********************************/
+
+void editor_toggle_wrap(void);
+int editor_row_wrap(erow * row);
+int editor_row_wrap_start(erow * row, int seg);
+int editor_row_wrap_seg(erow * row, int rbyte);
+int editor_wrap_rows(int line);
+void editor_wrap_move(int * line, int * seg, int n);
+int editor_wrap_distance(int line, int seg, int to_line, int to_seg, int limit);
+void editor_wrap_scroll(void);
+void editor_wrap_page(int n);
 
 /********************************
 * Syntax Highlighting
 ********************************/
 
 void editor_update_syntax(erow * row);
+void editor_syntax_window(erow * row, int state);
+int editor_syntax_finish(int idle);
+void editor_syntax_row_end(erow * row);
+void editor_syntax_stale(erow * row);
+int editor_syntax_scan(const char * s, int len, int avail, unsigned char * hl, int state);
+unsigned int editor_syntax_run_mask(const struct hl_run * run, const char * s);
+int editor_syntax_run(const struct hl_run * run, const char * s, int from, int len);
+struct hl_move editor_syntax_move(struct editor_syntax * syntax, struct hl_lexer * lexer, int at, int c);
+int editor_syntax_row_state(erow * row);
+int editor_syntax_carry(int state);
+unsigned int keyword_hash(const char * s, int len, unsigned int seed);
+void editor_syntax_lexer(struct editor_syntax * syntax);
+int editor_syntax_is_separator(struct editor_syntax * syntax, int c);
+void editor_syntax_init_lexer(struct editor_syntax * syntax, struct hl_lexer * lexer);
+void editor_syntax_compile(struct editor_syntax * syntax);
+void editor_syntax_compile_runs(struct hl_lexer * lexer);
+void editor_syntax_compile_keywords(struct editor_syntax * syntax);
+void editor_syntax_keyword_slot(struct hl_keyword * slot, const char * word);
+int editor_syntax_keyword(struct hl_lexer * lexer, const char * s, int len);
 void editor_select_syntax_highlight();
 int editor_syntax_to_color(int hl);
-int is_separator(int c);
+
+/********************************
+* Syntax Files
+********************************/
+
+void editor_init_syntaxes(void);
+void editor_load_syntaxes(const char * dir, const char * cache_dir);
+int editor_load_syntax(const char * path, const char * cache_dir);
+int editor_syntax_parse(struct editor_syntax * syntax, char * text, int len, const char * name);
+char ** editor_syntax_append(char ** list, int * n, char * s);
+void editor_syntax_free(struct editor_syntax * syntax);
+int editor_syntax_cache_read(struct editor_syntax * syntax);
+void editor_syntax_cache_write(struct editor_syntax * syntax);
+
+/********************************
+* Background Highlighting
+********************************/
+
+void editor_hl_worker_start(void);
+void editor_hl_worker_stop(void);
+void * editor_hl_worker_thread(void * arg);
+int editor_hl_worker_poll(void);
+int editor_hl_worker_state(erow * row);
+int editor_hl_worker_guessed(erow * row);
+void editor_hl_worker_edited(int at);
+
+/********************************
+* UTF-8
+********************************/
+
+int utf8_is_ascii(const char * s, int len);
+int utf8_length(char lead);
+int utf8_decode(const char * s, int len, unsigned int * cp);
+int utf8_width(unsigned int cp);
 
 /********************************
 * File I/O
 ********************************/
 
+int editor_map_file(int fd);
+void editor_index_lines(int nthreads);
+unsigned int newline_mask(const char * p);
+void * editor_index_chunk(void * arg);
+char * editor_file_line(int line, int * len);
+char * editor_file_line_len(char * start, int * len);
+size_t editor_file_offset(int line);
+int editor_file_line_of(size_t pos);
+char * editor_file_next_line(char * line, int len, int * next_len);
 void editor_open(char * filename);
-char * editor_rows_to_string(int * buflen);
+void save_push(const char * p, size_t len);
+int save_writev(int fd, struct iovec * iov, int iovcnt);
+void editor_save_rows(void);
+int editor_row_shared(erow * row);
+void editor_save_defer(char * p, size_t size);
+int editor_save_start(const char * filename);
+void * editor_save_thread(void * arg);
+int editor_save_poll(void);
+void editor_save_wait(void);
 void editor_save();
 
 /********************************
@@ -164,8 +613,13 @@ void editor_save();
 ********************************/
 
 int editor_read_key(void);
+int editor_read_byte(char * c);
+int editor_input_wait(long ms);
+long editor_now_ms(void);
 void enable_raw_mode(void);
 void disable_raw_mode(void);
 int get_window_size(int * rows, int * cols);
+void editor_sigwinch(int sig);
+void editor_handle_resize(void);
 int get_cursor_position(int * rows, int * cols);
 void unix_error(const char * s);